@@ -0,0 +1,35 @@
+/* malloc, calloc and realloc that exit the program when memory runs out */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "alloc.h"
+
+void *alloc(size_t size)
+{
+    void *ptr = malloc(size);
+    if(!ptr){
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+void *allocz(size_t size)
+{
+    void *ptr = calloc(size, 1);
+    if(!ptr){
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+void *ralloc(void *ptr, size_t size)
+{
+    ptr = realloc(ptr, size);
+    if(!ptr){
+        perror("Memory Allocation Error");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
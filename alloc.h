@@ -0,0 +1,10 @@
+#ifndef ALLOC_H_
+#define ALLOC_H_
+
+#include <stddef.h>
+
+extern void *alloc(size_t size);
+extern void *allocz(size_t size);
+extern void *ralloc(void *ptr, size_t size);
+
+#endif
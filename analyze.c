@@ -0,0 +1,661 @@
+/* Trace analyzer: flow, latency, backoff and channel statistics from a csma trace */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "shared.h"
+#include "trace.h"
+
+#define MAX_K 33
+
+typedef struct flow_s flow_s;
+typedef struct node_s node_s;
+typedef struct sample_s sample_s;
+typedef struct chunk_s chunk_s;
+typedef struct link_s link_s;
+
+/* Exchanges one station had with one destination */
+struct flow_s
+{
+    char peer[TRACE_PEER];
+    uint64_t rts;
+    uint64_t cts;
+    uint64_t acked;
+    uint64_t dropped;
+    uint64_t timeouts;
+    uint64_t bytes;
+};
+
+/*
+ A station as seen by one chunk. An exchange runs from its first RTS_TX
+ to the ACK_RX or DROP that ends it, and busy adds up the last attempt
+ of each acked one. Events before the chunk's first ACK_RX or DROP may
+ belong to an exchange that started in an earlier chunk, so they are
+ kept aside in head and only matched once chunks are merged in order.
+ The AP reuses the ids of killed stations, so each NODE record starts
+ a fresh node for its id; events before a chunk's first NODE for an
+ id carry on whichever station held it when the chunk began.
+ */
+struct node_s
+{
+    char name[TRACE_PEER+1];
+    uint32_t station;
+    bool fresh;
+    int channel;
+    flow_s *flows;
+    int nflows;
+    uint64_t open_first;
+    uint64_t open_last;
+    uint64_t head_first;
+    uint64_t head_last;
+    const trace_rec_s *head_end;
+    uint64_t busy;
+};
+
+/* RTS-to-ACK time of one acked exchange, by index in its chunk's nodes */
+struct sample_s
+{
+    uint64_t ns;
+    int node;
+    char peer[TRACE_PEER];
+};
+
+/* What the AP saw on one channel */
+struct link_s
+{
+    uint64_t delivered;
+    uint64_t bytes;
+    uint64_t fcs_errors;
+    uint64_t timeouts;
+};
+
+/* A run of records scanned by one thread */
+struct chunk_s
+{
+    const trace_rec_s *recs;
+    uint64_t count;
+    pthread_t thread;
+    node_s *nodes;
+    int nnodes;
+    int nodes_size;
+    int *slot;
+    sample_s *samples;
+    size_t nsamples;
+    size_t samples_size;
+    link_s links[MAX_CHANNELS];
+    uint64_t events[TRACE_TYPES];
+    uint64_t k_rts[MAX_K];
+    uint64_t k_acked[MAX_K];
+    uint64_t first_ns;
+    uint64_t last_ns;
+};
+
+static const trace_hdr_s *hdr;
+static chunk_s *chunks;
+static int nchunks;
+static bool json;
+
+static void *scan(void *arg);
+static int node_new(chunk_s *c, uint32_t station, bool fresh);
+static int node_find(chunk_s *c, uint32_t station);
+static flow_s *flow_find(node_s *n, const char *peer);
+static void sample_add(chunk_s *c, int node, const char *peer, uint64_t ns);
+static void merge(chunk_s *total);
+static void merge_node(chunk_s *total, node_s *g, int node, node_s *n);
+static int flow_cmp(const void *a, const void *b);
+static int sample_cmp(const void *a, const void *b);
+static int ns_cmp(const void *a, const void *b);
+static uint64_t percentile(const uint64_t *v, size_t n, double p);
+static void report(chunk_s *total);
+static void report_flows(chunk_s *total, double span);
+static void report_channels(chunk_s *total, double span);
+static void report_latency(chunk_s *total);
+static void report_k(chunk_s *total);
+static void report_events(chunk_s *total);
+
+int main(int argc, char *argv[])
+{
+    int c, i, threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    size_t size;
+    uint64_t count, per;
+    chunk_s total;
+    
+    while((c = getopt(argc, argv, "j:f:")) != -1) {
+        switch(c) {
+            case 'j':
+                threads = atoi(optarg);
+                break;
+            case 'f':
+                if(strcmp(optarg, "csv") && strcmp(optarg, "json")) {
+                    fprintf(stderr, "Format must be csv or json\n");
+                    exit(EXIT_FAILURE);
+                }
+                json = !strcmp(optarg, "json");
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-j threads] [-f csv|json] file\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-j threads] [-f csv|json] file\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if(threads < 1)
+        threads = 1;
+    
+    hdr = trace_open(argv[optind], &size);
+    count = hdr->count < hdr->capacity ? hdr->count : hdr->capacity;
+    madvise((void *)hdr, size, MADV_SEQUENTIAL);
+    
+    /* one contiguous run of records per thread */
+    nchunks = (uint64_t)threads < count ? threads : (count ? (int)count : 1);
+    chunks = allocz(nchunks*sizeof(*chunks));
+    per = count/nchunks;
+    for(i = 0; i < nchunks; i++) {
+        chunks[i].recs = (const trace_rec_s *)(hdr + 1) + i*per;
+        chunks[i].count = i == nchunks-1 ? count - i*per : per;
+        if(pthread_create(&chunks[i].thread, NULL, scan, &chunks[i])) {
+            perror("Failed to create scan thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(i = 0; i < nchunks; i++)
+        pthread_join(chunks[i].thread, NULL);
+    
+    merge(&total);
+    report(&total);
+    munmap((void *)hdr, size);
+    exit(EXIT_SUCCESS);
+}
+
+void *scan(void *arg)
+{
+    chunk_s *c = arg;
+    const trace_rec_s *rec, *end = c->recs + c->count;
+    node_s *n;
+    flow_s *f;
+    int i, K;
+    
+    c->slot = allocz(MAX_STATIONS*sizeof(*c->slot));
+    c->first_ns = UINT64_MAX;
+    for(rec = c->recs; rec < end; rec++) {
+        if(rec->type == TRACE_NONE || rec->type >= TRACE_TYPES)
+            continue;
+        c->events[rec->type]++;
+        if(rec->ns < c->first_ns)
+            c->first_ns = rec->ns;
+        if(rec->ns > c->last_ns)
+            c->last_ns = rec->ns;
+    
+        if(rec->station == TRACE_AP) {
+            if(rec->K >= MAX_CHANNELS)
+                continue;
+            if(rec->type == TRACE_DELIVER) {
+                c->links[rec->K].delivered++;
+                c->links[rec->K].bytes += rec->size;
+            }
+            else if(rec->type == TRACE_FCS_ERROR)
+                c->links[rec->K].fcs_errors++;
+            else if(rec->type == TRACE_AP_TIMEOUT)
+                c->links[rec->K].timeouts++;
+            continue;
+        }
+        if(rec->station >= MAX_STATIONS)
+            continue;
+        i = rec->type == TRACE_NODE ? node_new(c, rec->station, true) : node_find(c, rec->station);
+        n = &c->nodes[i];
+        K = rec->K < MAX_K ? rec->K : MAX_K-1;
+    
+        switch(rec->type) {
+            case TRACE_NODE:
+                memcpy(n->name, rec->peer, TRACE_PEER);
+                n->channel = rec->K;
+                break;
+            case TRACE_RTS_TX:
+                flow_find(n, rec->peer)->rts++;
+                c->k_rts[K]++;
+                if(!n->head_end) {
+                    if(!n->head_first)
+                        n->head_first = rec->ns;
+                    n->head_last = rec->ns;
+                }
+                else {
+                    if(!n->open_first)
+                        n->open_first = rec->ns;
+                    n->open_last = rec->ns;
+                }
+                break;
+            case TRACE_CTS_RX:
+                flow_find(n, rec->peer)->cts++;
+                break;
+            case TRACE_TIMEOUT:
+                flow_find(n, rec->peer)->timeouts++;
+                break;
+            case TRACE_ACK_RX:
+            case TRACE_DROP:
+                f = flow_find(n, rec->peer);
+                if(rec->type == TRACE_ACK_RX) {
+                    f->acked++;
+                    f->bytes += rec->size;
+                    c->k_acked[K]++;
+                }
+                else
+                    f->dropped++;
+                if(!n->head_end) {
+                    n->head_end = rec;
+                    break;
+                }
+                if(rec->type == TRACE_ACK_RX && n->open_first) {
+                    sample_add(c, i, rec->peer, rec->ns - n->open_first);
+                    n->busy += rec->ns - n->open_last;
+                }
+                n->open_first = n->open_last = 0;
+                break;
+            default:
+                break;
+        }
+    }
+    return NULL;
+}
+
+/* Add a node for station to the chunk and make it the one its records go to */
+int node_new(chunk_s *c, uint32_t station, bool fresh)
+{
+    if(c->nnodes == c->nodes_size) {
+        c->nodes_size = c->nodes_size ? 2*c->nodes_size : 64;
+        c->nodes = ralloc(c->nodes, c->nodes_size*sizeof(*c->nodes));
+    }
+    memset(&c->nodes[c->nnodes], 0, sizeof(*c->nodes));
+    c->nodes[c->nnodes].station = station;
+    c->nodes[c->nnodes].fresh = fresh;
+    c->slot[station] = c->nnodes + 1;
+    return c->nnodes++;
+}
+
+/* The node station's records currently go to, started if it has none */
+int node_find(chunk_s *c, uint32_t station)
+{
+    return c->slot[station] ? c->slot[station] - 1 : node_new(c, station, false);
+}
+
+flow_s *flow_find(node_s *n, const char *peer)
+{
+    int i;
+    
+    for(i = 0; i < n->nflows; i++)
+        if(!memcmp(n->flows[i].peer, peer, TRACE_PEER))
+            return &n->flows[i];
+    n->flows = ralloc(n->flows, (n->nflows+1)*sizeof(*n->flows));
+    memset(&n->flows[n->nflows], 0, sizeof(*n->flows));
+    memcpy(n->flows[n->nflows].peer, peer, TRACE_PEER);
+    return &n->flows[n->nflows++];
+}
+
+void sample_add(chunk_s *c, int node, const char *peer, uint64_t ns)
+{
+    if(c->nsamples == c->samples_size) {
+        c->samples_size = c->samples_size ? 2*c->samples_size : 1024;
+        c->samples = ralloc(c->samples, c->samples_size*sizeof(*c->samples));
+    }
+    c->samples[c->nsamples].ns = ns;
+    c->samples[c->nsamples].node = node;
+    memcpy(c->samples[c->nsamples].peer, peer, TRACE_PEER);
+    c->nsamples++;
+}
+
+/*
+ Fold the chunks into total in record order. A chunk's nodes were
+ started in record order too, so each is matched to the node its id
+ stands for at that point: a continuation to the current one, a fresh
+ one to a new node, unless the current one has not been named yet
+ because its NODE record trailed its first events.
+ */
+void merge(chunk_s *total)
+{
+    int i, j, t, *map;
+    node_s *n;
+    chunk_s *c;
+    
+    memset(total, 0, sizeof(*total));
+    total->slot = allocz(MAX_STATIONS*sizeof(*total->slot));
+    total->first_ns = UINT64_MAX;
+    for(i = 0; i < nchunks; i++) {
+        c = &chunks[i];
+        if(c->first_ns < total->first_ns)
+            total->first_ns = c->first_ns;
+        if(c->last_ns > total->last_ns)
+            total->last_ns = c->last_ns;
+        for(t = 0; t < TRACE_TYPES; t++)
+            total->events[t] += c->events[t];
+        for(t = 0; t < MAX_K; t++) {
+            total->k_rts[t] += c->k_rts[t];
+            total->k_acked[t] += c->k_acked[t];
+        }
+        for(t = 0; t < MAX_CHANNELS; t++) {
+            total->links[t].delivered += c->links[t].delivered;
+            total->links[t].bytes += c->links[t].bytes;
+            total->links[t].fcs_errors += c->links[t].fcs_errors;
+            total->links[t].timeouts += c->links[t].timeouts;
+        }
+    
+        map = alloc((c->nnodes ? c->nnodes : 1)*sizeof(*map));
+        for(j = 0; j < c->nnodes; j++) {
+            n = &c->nodes[j];
+            if(!total->slot[n->station])
+                map[j] = node_new(total, n->station, n->fresh);
+            else if(n->fresh && total->nodes[total->slot[n->station] - 1].name[0])
+                map[j] = node_new(total, n->station, true);
+            else
+                map[j] = total->slot[n->station] - 1;
+            merge_node(total, &total->nodes[map[j]], map[j], n);
+            free(n->flows);
+        }
+        for(j = 0; j < (int)c->nsamples; j++)
+            sample_add(total, map[c->samples[j].node], c->samples[j].peer, c->samples[j].ns);
+        free(map);
+        free(c->nodes);
+        free(c->slot);
+        free(c->samples);
+    }
+    if(total->first_ns > total->last_ns)
+        total->first_ns = total->last_ns;
+}
+
+/*
+ Fold one chunk's view of a station into its node in total. An
+ exchange left open at the end of one chunk is carried into the next
+ until its ACK_RX or DROP turns up; since a station writes its own
+ records in order, that is the first one in its head.
+ */
+void merge_node(chunk_s *total, node_s *g, int node, node_s *n)
+{
+    int j;
+    flow_s *f;
+    uint64_t first, last;
+    
+    if(n->name[0]) {
+        memcpy(g->name, n->name, sizeof(g->name));
+        g->channel = n->channel;
+    }
+    for(j = 0; j < n->nflows; j++) {
+        f = flow_find(g, n->flows[j].peer);
+        f->rts += n->flows[j].rts;
+        f->cts += n->flows[j].cts;
+        f->acked += n->flows[j].acked;
+        f->dropped += n->flows[j].dropped;
+        f->timeouts += n->flows[j].timeouts;
+        f->bytes += n->flows[j].bytes;
+    }
+    g->busy += n->busy;
+    
+    /* open_first/open_last carry the exchange still in progress */
+    if(n->head_end) {
+        first = g->open_first ? g->open_first : n->head_first;
+        last = n->head_last ? n->head_last : g->open_last;
+        if(n->head_end->type == TRACE_ACK_RX && first) {
+            sample_add(total, node, n->head_end->peer, n->head_end->ns - first);
+            g->busy += n->head_end->ns - last;
+        }
+        g->open_first = n->open_first;
+        g->open_last = n->open_last;
+    }
+    else if(n->head_first) {
+        if(!g->open_first)
+            g->open_first = n->head_first;
+        g->open_last = n->head_last;
+    }
+}
+
+int flow_cmp(const void *a, const void *b)
+{
+    return memcmp(((const flow_s *)a)->peer, ((const flow_s *)b)->peer, TRACE_PEER);
+}
+
+int sample_cmp(const void *a, const void *b)
+{
+    const sample_s *x = a, *y = b;
+    int d;
+    
+    if(x->node != y->node)
+        return x->node < y->node ? -1 : 1;
+    d = memcmp(x->peer, y->peer, TRACE_PEER);
+    if(d)
+        return d;
+    return x->ns < y->ns ? -1 : x->ns > y->ns;
+}
+
+int ns_cmp(const void *a, const void *b)
+{
+    const uint64_t *x = a, *y = b;
+    
+    return *x < *y ? -1 : *x > *y;
+}
+
+/* Nearest rank on sorted values */
+uint64_t percentile(const uint64_t *v, size_t n, double p)
+{
+    size_t rank = (size_t)(p*n + 0.999999);
+    
+    if(!n)
+        return 0;
+    return v[rank ? rank-1 : 0];
+}
+
+void report(chunk_s *total)
+{
+    double span = (total->last_ns - total->first_ns)*1e-9;
+    uint64_t dropped = hdr->count > hdr->capacity ? hdr->count - hdr->capacity : 0;
+    int s;
+    
+    /* flows and samples in the same order, so report_flows can walk both */
+    for(s = 0; s < total->nnodes; s++)
+        qsort(total->nodes[s].flows, total->nodes[s].nflows, sizeof(flow_s), flow_cmp);
+    qsort(total->samples, total->nsamples, sizeof(*total->samples), sample_cmp);
+    if(json)
+        printf("{\"span_s\": %.9f, \"records\": %" PRIu64 ", \"dropped\": %" PRIu64 ",\n",
+               span, hdr->count - dropped, dropped);
+    else
+        printf("# run\nspan_s,records,dropped\n%.9f,%" PRIu64 ",%" PRIu64 "\n",
+               span, hdr->count - dropped, dropped);
+    if(span <= 0)
+        span = 1e-9;
+    report_flows(total, span);
+    report_channels(total, span);
+    report_latency(total);
+    report_k(total);
+    report_events(total);
+    if(json)
+        printf("}\n");
+}
+
+/* Per station and destination, with the latency of that flow's acked exchanges */
+void report_flows(chunk_s *total, double span)
+{
+    int s, i;
+    node_s *n;
+    flow_s *f;
+    sample_s *p = total->samples, *end = total->samples + total->nsamples;
+    uint64_t *v = alloc((total->nsamples ? total->nsamples : 1)*sizeof(*v));
+    size_t nv;
+    double sum;
+    bool first = true;
+    
+    if(json)
+        printf("\"flows\": [");
+    else
+        printf("\n# flows\nstation,dst,channel,rts,cts,acked,dropped,timeouts,bytes,"
+               "frames_per_s,kbit_per_s,latency_mean_us,latency_p50_us,latency_p99_us,latency_max_us\n");
+    for(s = 0; s < total->nnodes; s++) {
+        n = &total->nodes[s];
+        for(i = 0; i < n->nflows; i++) {
+            f = &n->flows[i];
+    
+            /* samples are sorted the same way, by node then destination */
+            while(p < end && (p->node < s || (p->node == s && memcmp(p->peer, f->peer, TRACE_PEER) < 0)))
+                p++;
+            for(nv = 0, sum = 0; p < end && p->node == s && !memcmp(p->peer, f->peer, TRACE_PEER); p++) {
+                v[nv++] = p->ns;
+                sum += p->ns;
+            }
+    
+            if(json)
+                printf("%s\n  {\"station\": \"%.6s\", \"dst\": \"%.6s\", \"channel\": %d, \"rts\": %" PRIu64
+                       ", \"cts\": %" PRIu64 ", \"acked\": %" PRIu64 ", \"dropped\": %" PRIu64
+                       ", \"timeouts\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"frames_per_s\": %.3f"
+                       ", \"kbit_per_s\": %.3f, \"latency_mean_us\": %.3f, \"latency_p50_us\": %.3f"
+                       ", \"latency_p99_us\": %.3f, \"latency_max_us\": %.3f}",
+                       first ? "" : ",", n->name, f->peer, n->channel, f->rts, f->cts, f->acked, f->dropped,
+                       f->timeouts, f->bytes, f->acked/span, f->bytes*8e-3/span, nv ? sum/nv*1e-3 : 0.0,
+                       percentile(v, nv, 0.5)*1e-3, percentile(v, nv, 0.99)*1e-3,
+                       nv ? v[nv-1]*1e-3 : 0.0);
+            else
+                printf("%.6s,%.6s,%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64
+                       ",%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+                       n->name, f->peer, n->channel, f->rts, f->cts, f->acked, f->dropped,
+                       f->timeouts, f->bytes, f->acked/span, f->bytes*8e-3/span, nv ? sum/nv*1e-3 : 0.0,
+                       percentile(v, nv, 0.5)*1e-3, percentile(v, nv, 0.99)*1e-3,
+                       nv ? v[nv-1]*1e-3 : 0.0);
+            first = false;
+        }
+    }
+    if(json)
+        printf("\n],\n");
+    free(v);
+}
+
+/*
+ Utilization is the share of the run taken by the last attempt of every
+ acked exchange, RTS_TX to ACK_RX. A frame the AP fails the FCS on is
+ counted as a collision, against the RTS sent on that channel.
+ */
+void report_channels(chunk_s *total, double span)
+{
+    int ch, s, last = 0;
+    uint64_t rts[MAX_CHANNELS] = {0}, timeouts[MAX_CHANNELS] = {0}, busy[MAX_CHANNELS] = {0};
+    int stations[MAX_CHANNELS] = {0};
+    node_s *n;
+    link_s *l;
+    int i;
+    
+    for(s = 0; s < total->nnodes; s++) {
+        n = &total->nodes[s];
+        if(!n->name[0] || n->channel >= MAX_CHANNELS)
+            continue;
+        stations[n->channel]++;
+        busy[n->channel] += n->busy;
+        for(i = 0; i < n->nflows; i++) {
+            rts[n->channel] += n->flows[i].rts;
+            timeouts[n->channel] += n->flows[i].timeouts;
+        }
+        if(n->channel > last)
+            last = n->channel;
+    }
+    for(ch = 0; ch < MAX_CHANNELS; ch++)
+        if(total->links[ch].delivered || total->links[ch].fcs_errors || total->links[ch].timeouts)
+            if(ch > last)
+                last = ch;
+    
+    if(json)
+        printf("\"channels\": [");
+    else
+        printf("\n# channels\nchannel,stations,rts,delivered,bytes,frames_per_s,kbit_per_s,"
+               "fcs_errors,ap_timeouts,station_timeouts,utilization,collision_rate\n");
+    for(ch = 0; ch <= last; ch++) {
+        l = &total->links[ch];
+        if(json)
+            printf("%s\n  {\"channel\": %d, \"stations\": %d, \"rts\": %" PRIu64 ", \"delivered\": %" PRIu64
+                   ", \"bytes\": %" PRIu64 ", \"frames_per_s\": %.3f, \"kbit_per_s\": %.3f"
+                   ", \"fcs_errors\": %" PRIu64 ", \"ap_timeouts\": %" PRIu64 ", \"station_timeouts\": %" PRIu64
+                   ", \"utilization\": %.6f, \"collision_rate\": %.6f}",
+                   ch ? "," : "", ch, stations[ch], rts[ch], l->delivered, l->bytes,
+                   l->delivered/span, l->bytes*8e-3/span, l->fcs_errors, l->timeouts, timeouts[ch],
+                   busy[ch]*1e-9/span, rts[ch] ? (double)l->fcs_errors/rts[ch] : 0.0);
+        else
+            printf("%d,%d,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.3f,%.3f,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.6f,%.6f\n",
+                   ch, stations[ch], rts[ch], l->delivered, l->bytes,
+                   l->delivered/span, l->bytes*8e-3/span, l->fcs_errors, l->timeouts, timeouts[ch],
+                   busy[ch]*1e-9/span, rts[ch] ? (double)l->fcs_errors/rts[ch] : 0.0);
+    }
+    if(json)
+        printf("\n],\n");
+}
+
+/* RTS-to-ACK distribution over every acked exchange */
+void report_latency(chunk_s *total)
+{
+    static const double ps[] = {0.5, 0.9, 0.99, 0.999};
+    static const char *names[] = {"p50", "p90", "p99", "p999"};
+    uint64_t *v = alloc((total->nsamples ? total->nsamples : 1)*sizeof(*v));
+    size_t i, n = total->nsamples;
+    double sum = 0;
+    
+    for(i = 0; i < n; i++) {
+        v[i] = total->samples[i].ns;
+        sum += v[i];
+    }
+    qsort(v, n, sizeof(*v), ns_cmp);
+    
+    if(json)
+        printf("\"latency_us\": {\"count\": %zu, \"mean\": %.3f", n, n ? sum/n*1e-3 : 0.0);
+    else
+        printf("\n# latency_us\ncount,mean,p50,p90,p99,p999,max\n%zu,%.3f", n, n ? sum/n*1e-3 : 0.0);
+    for(i = 0; i < sizeof(ps)/sizeof(*ps); i++) {
+        if(json)
+            printf(", \"%s\": %.3f", names[i], percentile(v, n, ps[i])*1e-3);
+        else
+            printf(",%.3f", percentile(v, n, ps[i])*1e-3);
+    }
+    if(json)
+        printf(", \"max\": %.3f},\n", n ? v[n-1]*1e-3 : 0.0);
+    else
+        printf(",%.3f\n", n ? v[n-1]*1e-3 : 0.0);
+    free(v);
+}
+
+/* RTS sent at each K, and the K exchanges were acked at, i.e. their backoffs */
+void report_k(chunk_s *total)
+{
+    int K, last = 0;
+    
+    for(K = 0; K < MAX_K; K++)
+        if(total->k_rts[K] || total->k_acked[K])
+            last = K;
+    if(json)
+        printf("\"k\": [");
+    else
+        printf("\n# k\nK,rts,acked\n");
+    for(K = 0; K <= last; K++) {
+        if(json)
+            printf("%s\n  {\"K\": %d, \"rts\": %" PRIu64 ", \"acked\": %" PRIu64 "}",
+                   K ? "," : "", K, total->k_rts[K], total->k_acked[K]);
+        else
+            printf("%d,%" PRIu64 ",%" PRIu64 "\n", K, total->k_rts[K], total->k_acked[K]);
+    }
+    if(json)
+        printf("\n],\n");
+}
+
+/* Records of each type, named as in the decoder */
+void report_events(chunk_s *total)
+{
+    int t;
+    
+    if(json)
+        printf("\"events\": {");
+    else
+        printf("\n# events\ntype,count\n");
+    for(t = TRACE_NODE; t < TRACE_TYPES; t++) {
+        if(json)
+            printf("%s\"%s\": %" PRIu64, t == TRACE_NODE ? "" : ", ", trace_name(t), total->events[t]);
+        else
+            printf("%s,%" PRIu64 "\n", trace_name(t), total->events[t]);
+    }
+    if(json)
+        printf("}\n");
+}
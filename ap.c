@@ -8,59 +8,291 @@
 #include <stdint.h>
 #include <errno.h>
 
-#include <zlib.h>
 #include <termios.h>
 #include <signal.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/types.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <spawn.h>
 
 #include "parse.h"
 #include "shared.h"
+#include "sim.h"
+#include "station.h"
+#include "co.h"
+#include "trace.h"
 
 #define CLIENT_PATH "./client"
+#define POOL_SIZE 8
+#define READY_TIMEOUT 1.0
+
+extern char **environ;
 
 typedef struct station_s station_s;
+typedef struct channel_s channel_s;
+typedef struct member_s member_s;
 
-struct station_s
+/*
+ A client process, either idle in the pool or serving one station.
+ slot is the mailbox slot its commands are being bundled into until
+ the next flush, and outbox links the members that have one open.
+ */
+struct member_s
 {
     pid_t pid;
-    int pipe[2];
+    int id;
+    medium_s *mailbox;
+    slot_s *slot;
+    uint64_t pos;
+    bool queued;
+    member_s *outbox;
+    member_s *next;
+};
+
+/*
+ A station and the id its inbox and stats slot go by. Once killed it
+ waits on the retired list, with the request thread epochs it was
+ killed at, until its id can be handed to a new node.
+ */
+struct station_s
+{
+    member_s *member;
+    int channel;
+    int id;
+    char addr[ADDR_SIZE+1];
+    medium_s *inbox;
+    mac_s *mac;
+    uint64_t *epochs;
+    station_s *next;
+};
+
+/*
+ An uplink/downlink medium pair serviced by its own thread. delivered
+ and bytes count acked payloads, for the goodput report. epoch counts
+ the thread's trips round its loop; no inbox it looked up is in use
+ once it has moved on.
+ */
+struct channel_s
+{
+    int id;
+    medium_s *mediums;
+    medium_s *mediumc;
+    pthread_t thread;
+    uint64_t delivered;
+    uint64_t bytes;
+    uint64_t epoch;
 };
 
 sym_table_s station_table;
 pthread_mutex_t station_table_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static int shm_mediums;
-static int shm_mediumc;
+/*
+ Stations by 6 byte address for the request threads. kill() removes a
+ station from here, but its inbox stays mapped and its id is not given
+ out again until station_idle says no request thread can still be
+ delivering to it.
+ */
+static sym_table_s addr_table;
+static pthread_rwlock_t addr_table_lock = PTHREAD_RWLOCK_INITIALIZER;
+static int nstations;
+
+/* killed stations, oldest first, and the access delay they had recorded */
+static station_s *retired, **retired_tail = &retired;
+static latency_s *retired_latency;
+
+static channel_s channels[MAX_CHANNELS];
+static int nchannels = 1;
+static size_t medium_capacity = MEDIUM_SIZE;
+static medium_mode_e medium_mode = MEDIUM_RING;
+static uint32_t spin_budget = SPIN_BUDGET;
+static char run_name[SHM_NAME_SIZE/2];
+static bool huge_pages;
+static uint32_t agg_count = 1;
+static uint32_t agg_bytes;
+static double sim_time;
+static int sim_parts = 1;
+static int workers;
+
+/* every station's generator is seeded from this and its name, see rng.h */
+static uint64_t run_seed;
+static bool seeded;
+
+/* -t maps a binary event trace of this many records, shared with every client */
+static uint64_t trace_records;
+static char trace_path[SHM_NAME_SIZE];
+
+/* live counters for csma-stats, see stats.h */
+static stats_s *stats;
+
+/*
+ Client processes already attached to every channel, waiting for node()
+ to give them an identity. The pool is filled at start-up and kill()
+ hands processes back to it; node() forks only when it runs dry.
+ A batch forks what it is short of up front, and reserved says how
+ many of its takes those are, so they count as misses.
+ */
+static member_s *pool;
+static int pool_idle;
+static int pool_reserved;
+static int pool_size = POOL_SIZE;
+static uint64_t pool_hits, pool_misses, pool_returns;
+static ready_s *ready;
+static uint32_t spawned;
+static int nmembers;
+static member_s *outbox;
+static const struct timespec mailbox_retry = {0, 100000};
 
 static void process_tasks(void);
-static void create_node(char *id, char *ifs);
+static int queued_nodes(void);
+static medium_s *create_medium(char kind, int channel, bool broadcast);
+static void remove_segments(void);
+static void create_node(char *id, char *ifs, char *channel, char *seed);
+static uint64_t station_seed(char *id, char *seed);
 static void send_message(send_s *send);
 static void *process_request(void *);
 static void kill_child(station_s *s);
 static void kill_childid(char *id);
-static void send_ack_cts(char *addr1, int type);
-static void deliver_message(char *addr1, char *addr2, char *payload, size_t size);
+static station_s *station_reuse(void);
+static bool station_idle(station_s *s);
+static void send_ack_cts(channel_s *ch, char *addr1, int type);
+static medium_s *station_inbox(char *addr);
+static void create_local_node(station_s *station, char *id, char *ifs, uint64_t seed);
+static void station_run(void *arg);
+static void station_receive(void *arg);
+static int deliver_aggregate(channel_s *ch, medium_s *inbox, char *src, char *payload, size_t size);
+static void goodput_report(double elapsed);
+static void latency_report(void);
+static uint64_t clock_ns(void);
+static member_s *pool_spawn(void);
+static void pool_grow(int n);
+static member_s *pool_take(void);
+static void pool_return(member_s *member);
+static void pool_fill(void);
+static void pool_drain(void);
+static void member_terminate(member_s *member);
+static void mailbox_append(member_s *member, cmd_s *cmd, char **fields);
+static void mailbox_flush(void);
 
-static void sigUSR1(int sig);
 static void sigUSR2(int sig);
 
 int main(int argc, char *argv[])
 {
     int c, status;
-    char *src;
+    char *src, *end;
     buf_s *in;
     struct sigaction sa;
     sym_record_s *rec, *recb;
-    pthread_t req_thread;
     sigset_t mask;
+    char shm[SHM_NAME_SIZE];
+    struct timespec started, stopped;
+    
+    snprintf(run_name, sizeof(run_name), "%s-%d", SHM_PREFIX, (int)getpid());
     
-    if(argc > 1) {
-        src = readfile(argv[1]);
+    while((c = getopt(argc, argv, "sbw:c:m:n:Ha:S:P:i:p:r:l:t:")) != -1) {
+        switch(c) {
+            case 's':
+                medium_mode = MEDIUM_SLOW;
+                break;
+            case 'b':
+                medium_mode = MEDIUM_BULK;
+                break;
+            case 'w':
+                spin_budget = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                nchannels = atoi(optarg);
+                if(nchannels < 1 || nchannels > MAX_CHANNELS) {
+                    fprintf(stderr, "Number of channels must be between 1 and %d\n", MAX_CHANNELS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                /* an RTS announces the payload in its 16 bit D field */
+                medium_capacity = strtoul(optarg, NULL, 10);
+                if(medium_capacity < sizeof(rts_s) || medium_capacity > UINT16_MAX + sizeof(uint32_t)) {
+                    fprintf(stderr, "Medium capacity must be between %zu and %zu bytes\n",
+                            sizeof(rts_s), UINT16_MAX + sizeof(uint32_t));
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                if(strchr(optarg, '/') || strlen(optarg) >= sizeof(run_name)) {
+                    fprintf(stderr, "Run name must be under %zu characters without '/'\n", sizeof(run_name));
+                    exit(EXIT_FAILURE);
+                }
+                strcpy(run_name, optarg);
+                break;
+            case 'H':
+                huge_pages = true;
+                break;
+            case 'a':
+                agg_count = (uint32_t)strtoul(optarg, &end, 10);
+                if(*end == ':')
+                    agg_bytes = (uint32_t)strtoul(end+1, NULL, 10);
+                /* every frame of an aggregate takes its own inbox slot */
+                if(agg_count < 1 || agg_count > AGG_MAX || agg_count > MEDIUM_SLOTS) {
+                    fprintf(stderr, "Aggregate count must be between 1 and %d\n",
+                            AGG_MAX < MEDIUM_SLOTS ? AGG_MAX : MEDIUM_SLOTS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                sim_parts = atoi(optarg);
+                if(sim_parts < 1 || sim_parts > MAX_CHANNELS) {
+                    fprintf(stderr, "Number of partitions must be between 1 and %d\n", MAX_CHANNELS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'i':
+                workers = atoi(optarg);
+                if(workers < 1 || workers > CO_MAX_WORKERS) {
+                    fprintf(stderr, "Number of workers must be between 1 and %d\n", CO_MAX_WORKERS);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                pool_size = atoi(optarg);
+                if(pool_size < 0) {
+                    fprintf(stderr, "Pool size must not be negative\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'S':
+                sim_time = strtod(optarg, NULL);
+                if(sim_time <= 0) {
+                    fprintf(stderr, "Simulated time must be positive\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                run_seed = strtoull(optarg, NULL, 0);
+                seeded = true;
+                break;
+            case 'l':
+                log_level = atoi(optarg);
+                if(log_level < LOG_ERROR || log_level > LOG_DEBUG) {
+                    fprintf(stderr, "Log level must be between %d and %d\n", LOG_ERROR, LOG_DEBUG);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                trace_records = strtoull(optarg, NULL, 10);
+                if(!trace_records)
+                    trace_records = TRACE_RECORDS;
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s [-s | -b] [-w spins] [-c channels] [-m bytes] [-n run] [-H] [-a count[:bytes]] [-S secs [-P parts]] [-i workers] [-p pool] [-r seed] [-l level] [-t records] [file]\n",
+                        argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    
+    if(optind < argc) {
+        src = readfile(argv[optind]);
         parse(src);
         closefile();
     }
@@ -88,14 +320,28 @@ int main(int argc, char *argv[])
         perror("Error Creating file for redirection");
         exit(EXIT_FAILURE);
     }
+    logevent("FCS is CRC32C using %s", crc_impl());
     
-    sa.sa_handler = sigUSR1;
-    sa.sa_flags = SA_RESTART;
-    sigemptyset(&sa.sa_mask);
-    status = sigaction(SIGUSR1, &sa, NULL);
-    if(status < 0) {
-        perror("Error installing handler for SIGUSR1");
-        exit(EXIT_FAILURE);
+    /* simulations are repeatable by default, live runs log what to pass to -r */
+    if(!seeded)
+        run_seed = sim_time > 0 ? SIM_SEED : (uint64_t)time(NULL) ^ (uint64_t)getpid() << 32;
+    logevent("Run seed %llu", (unsigned long long)run_seed);
+    
+    if(trace_records) {
+        snprintf(trace_path, sizeof(trace_path), "out/%s.trace", run_name);
+        trace_create(trace_path, trace_records);
+        /* virtual time starts at zero */
+        if(sim_time > 0)
+            trace->start_ns = 0;
+        logevent("Tracing up to %llu events to %s", (unsigned long long)trace_records, trace_path);
+    }
+    
+    /* run the script in virtual time instead of spawning stations */
+    if(sim_time > 0) {
+        log_flush();
+        sim_run(sim_time, nchannels, medium_capacity, sim_parts, run_seed);
+        log_close(logfile);
+        exit(EXIT_SUCCESS);
     }
     
     sa.sa_handler = sigALARM;
@@ -107,36 +353,25 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    shm_mediums = shmget(SHM_KEY_S, sizeof(*mediums), IPC_CREAT|SHM_R|SHM_W);
-    if(shm_mediums < 0) {
-        perror("Failed to set up shared memory segment");
-        exit(EXIT_FAILURE);
-    }
-    
-    mediums = shmat(shm_mediums, NULL, 0);
-    if(mediums == (medium_s *)-1) {
-        perror("Failed to attached shared memory segment.");
-        exit(EXIT_FAILURE);
-    }
-    mediums->isbusy = false;
-    
-    shm_mediumc = shmget(SHM_KEY_C, sizeof(*mediumc), IPC_CREAT|SHM_R|SHM_W);
-    if(shm_mediumc < 0) {
-        perror("Failed to set up shared memory segment");
-        exit(EXIT_FAILURE);
-    }
-    
-    mediumc = shmat(shm_mediumc, NULL, 0);
-    if(mediumc == (medium_s *)-1) {
-        perror("Failed to attached shared memory segment.");
-        exit(EXIT_FAILURE);
-    }
-    mediumc->isbusy = false;
+    atexit(remove_segments);
+    shm_name(shm, run_name, STATS_KIND, 0);
+    stats = shm_create(shm, sizeof(*stats), false);
+    memcpy(stats->magic, STATS_MAGIC, sizeof(stats->magic));
+    stats->nchannels = nchannels;
+    stats->running = 1;
+    logevent("Live counters in %s, read with csma-stats %s", shm, run_name);
     
-    status = pthread_create(&req_thread, NULL, process_request, NULL);
-    if(status) {
-        perror("Failure to set up thread");
-        exit(EXIT_FAILURE);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    for(c = 0; c < nchannels; c++) {
+        channels[c].id = c;
+        channels[c].mediums = create_medium('s', c, false);
+        channels[c].mediumc = create_medium('c', c, true);
+        
+        status = pthread_create(&channels[c].thread, NULL, process_request, &channels[c]);
+        if(status) {
+            perror("Failure to set up thread");
+            exit(EXIT_FAILURE);
+        }
     }
     
     sigemptyset(&mask);
@@ -146,6 +381,16 @@ int main(int argc, char *argv[])
         perror("Failure to mask SIGUSR2 in parent thread.");
         exit(EXIT_FAILURE);
     }
+    
+    /* stations run as coroutines on this many threads instead of as processes */
+    if(workers)
+        co_init(workers);
+    else {
+        /* clients check in here once their mediums are mapped */
+        shm_name(shm, run_name, 'r', 0);
+        ready = shm_create(shm, sizeof(*ready), false);
+        pool_fill();
+    }
 
     process_tasks();
     
@@ -179,20 +424,91 @@ int main(int argc, char *argv[])
     pthread_mutex_unlock(&station_table_lock);
 
     pthread_mutex_destroy(&station_table_lock);
+    pool_drain();
     
-    fclose(logfile);
+    clock_gettime(CLOCK_MONOTONIC, &stopped);
+    goodput_report((stopped.tv_sec - started.tv_sec) + (stopped.tv_nsec - started.tv_nsec)*1e-9);
+    latency_report();
+    timer_report();
+    if(workers)
+        co_report();
+    else
+        logevent("Pool: %llu hits, %llu misses, %llu returns",
+                 (unsigned long long)pool_hits, (unsigned long long)pool_misses,
+                 (unsigned long long)pool_returns);
+    log_close(logfile);
     
     exit(EXIT_SUCCESS);
 }
 
+medium_s *create_medium(char kind, int channel, bool broadcast)
+{
+    medium_s *medium;
+    char shm[SHM_NAME_SIZE];
+    
+    shm_name(shm, run_name, kind, channel);
+    medium = shm_create(shm, medium_bytes(medium_capacity), huge_pages);
+    medium_init(medium, medium_mode, broadcast, spin_budget, medium_capacity);
+    
+    /* an aggregate and its FCS must still fit the medium */
+    if(kind == 's') {
+        medium->agg_count = agg_count;
+        if(agg_bytes && agg_bytes < medium->agg_bytes)
+            medium->agg_bytes = agg_bytes;
+    }
+    return medium;
+}
+
+void remove_segments(void)
+{
+    int c;
+    char shm[SHM_NAME_SIZE];
+    
+    for(c = 0; c < nchannels; c++) {
+        shm_name(shm, run_name, 's', c);
+        shm_remove(shm);
+        shm_name(shm, run_name, 'c', c);
+        shm_remove(shm);
+    }
+    for(c = 0; c < nstations; c++) {
+        shm_name(shm, run_name, 'i', c);
+        shm_remove(shm);
+    }
+    for(c = 0; c < nmembers; c++) {
+        shm_name(shm, run_name, 'q', c);
+        shm_remove(shm);
+    }
+    shm_name(shm, run_name, 'r', 0);
+    shm_remove(shm);
+    if(stats)
+        __atomic_store_n(&stats->running, 0, __ATOMIC_RELEASE);
+    shm_name(shm, run_name, STATS_KIND, 0);
+    shm_remove(shm);
+}
+
+/*
+ Run the queued tasks as one batch under station_table_lock. Commands
+ for each client are bundled and only published at the end, so a send
+ to a whole set costs one mailbox slot and one wake per source station.
+ */
 void process_tasks(void)
 {
     task_s *t;
+    int n;
     
+    /* start every process this batch of nodes needs before assigning any */
+    if(!workers && (n = queued_nodes()) > pool_idle) {
+        pool_reserved = n - pool_idle;
+        pool_misses += pool_reserved;
+        pool_grow(pool_reserved);
+    }
+    
+    pthread_mutex_lock(&station_table_lock);
     while((t = task_dequeue())) {
         switch(t->func) {
             case FNET_NODE:
-                create_node(*(char **)(t + 1), *((char **)(t + 1) + 1));
+                create_node(*(char **)(t + 1), *((char **)(t + 1) + 1), *((char **)(t + 1) + 2),
+                            *((char **)(t + 1) + 3));
                 break;
             case FNET_SEND:
                 send_message((send_s *)t);
@@ -204,192 +520,717 @@ void process_tasks(void)
         }
         free(t);
     }
+    pool_reserved = 0;
+    mailbox_flush();
+    pthread_mutex_unlock(&station_table_lock);
 }
 
-void create_node(char *id, char *ifs)
+/*
+ Stations the queued node() calls will create: names not running yet,
+ each counted once, on a channel that exists. Only the main thread
+ changes station_table, so it is read here without the lock.
+ */
+int queued_nodes(void)
 {
-    int status;
-    pid_t pid;
-    char *argv[5];
-    char fd_buf[4*sizeof(int)+4];
-    int fd[2];
+    task_s *t, *u;
+    char *id;
+    int ch, n = 0;
+    
+    for(t = tqueue.head; t; t = t->next) {
+        if(t->func != FNET_NODE)
+            continue;
+        id = *(char **)(t + 1);
+        ch = atoi(*((char **)(t + 1) + 2));
+        if(ch < 0 || ch >= nchannels || sym_lookup(&station_table, id))
+            continue;
+        for(u = tqueue.head; u != t; u = u->next)
+            if(u->func == FNET_NODE && !strcmp(*(char **)(u + 1), id))
+                break;
+        if(u == t)
+            n++;
+    }
+    return n;
+}
+
+void create_node(char *id, char *ifs, char *channel, char *seed)
+{
+    cmd_s cmd = {.func = FNET_NODE};
+    char seed_buf[4*sizeof(uint64_t)];
+    char *fields[CMD_FIELDS] = {id, ifs, seed_buf};
+    char shm[SHM_NAME_SIZE];
+    int ch = atoi(channel);
     station_s *station;
+    member_s *member;
+    
+    if(ch < 0 || ch >= nchannels) {
+        fprintf(stderr, "Node %s: channel %d out of range, only %d channel(s) configured\n", id, ch, nchannels);
+        return;
+    }
     
-    pthread_mutex_lock(&station_table_lock);
     if(!sym_lookup(&station_table, id)) {
-        status = pipe(fd);
-        if(status < 0) {
-            perror("Error Creating Pipe");
-            exit(EXIT_FAILURE);
+        station = station_reuse();
+        if(!station) {
+            if(nstations == MAX_STATIONS) {
+                fprintf(stderr, "Node %s: station limit of %d reached\n", id, MAX_STATIONS);
+                return;
+            }
+            station = allocz(sizeof(*station));
+            station->id = nstations++;
+            
+            /* frames land here with the sender's address in front */
+            shm_name(shm, run_name, 'i', station->id);
+            station->inbox = shm_create(shm, medium_bytes(medium_capacity + ADDR_SIZE), huge_pages);
+            __atomic_store_n(&stats->nstations, nstations, __ATOMIC_RELEASE);
         }
-        sprintf(fd_buf, "%d.%d", fd[0], fd[1]);
-        argv[0] = CLIENT_PATH;
-        argv[1] = id;
-        argv[2] = ifs;
-        argv[3] = fd_buf;
-        argv[4] = NULL;
+        medium_init(station->inbox, MEDIUM_RING, false, spin_budget, medium_capacity + ADDR_SIZE);
+        station->channel = ch;
+        memset(station->addr, 0, sizeof(station->addr));
+        strncpy(station->addr, &id[1], strlen(id)-2);
+        trace_emit(TRACE_NODE, station->id, station->addr, ch, 0, 0);
+        memcpy(stats->stations[station->id].name, station->addr, ADDR_SIZE);
+        stats->stations[station->id].channel = ch;
+        __atomic_store_n(&stats->stations[station->id].attached, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&stats->stations[station->id].active, 1, __ATOMIC_RELEASE);
         
-        pid = fork();
-        if(pid) {
-            /* wait for SIGUSR1 from child */
-            pause();
-            
-            station = alloc(sizeof(*station));
-            station->pid = pid;
-            station->pipe[0] = fd[0];
-            station->pipe[1] = fd[1];
-            
-            sym_insert(&station_table, id, (sym_data_u){.ptr = station});
+        if(workers) {
+            create_local_node(station, id, ifs, station_seed(id, seed));
+            return;
         }
-        else if(pid < 0) {
-            perror("Failed to create station process.");
-            exit(EXIT_FAILURE);
+        
+        /* give an idle client this station's identity */
+        member = pool_take();
+        cmd.channel = ch;
+        cmd.id = station->id;
+        snprintf(seed_buf, sizeof(seed_buf), "%llu", (unsigned long long)station_seed(id, seed));
+        cmd.len[0] = strlen(id) + 1;
+        cmd.len[1] = strlen(ifs) + 1;
+        cmd.len[2] = strlen(seed_buf) + 1;
+        mailbox_append(member, &cmd, fields);
+        station->member = member;
+        
+        sym_insert(&station_table, id, (sym_data_u){.ptr = station});
+        pthread_rwlock_wrlock(&addr_table_lock);
+        sym_insert(&addr_table, station->addr, (sym_data_u){.ptr = station});
+        pthread_rwlock_unlock(&addr_table_lock);
+    }
+}
+
+/* Start a client with every channel attached but no identity yet */
+member_s *pool_spawn(void)
+{
+    int status;
+    char *argv[7];
+    char id_buf[4*sizeof(int)];
+    char nch_buf[4*sizeof(int)];
+    char level_buf[4*sizeof(int)];
+    char shm[SHM_NAME_SIZE];
+    size_t capacity = sizeof(cmd_s) + CMD_TEXT_SIZE + medium_capacity;
+    member_s *member;
+    
+    /* commands for this client, posted by the AP and drained by it */
+    member = allocz(sizeof(*member));
+    member->id = nmembers++;
+    shm_name(shm, run_name, 'q', member->id);
+    member->mailbox = shm_create(shm, medium_bytes(capacity), false);
+    medium_init(member->mailbox, MEDIUM_RING, false, 0, capacity);
+    
+    sprintf(id_buf, "%d", member->id);
+    sprintf(nch_buf, "%d", nchannels);
+    sprintf(level_buf, "%d", log_level);
+    argv[0] = CLIENT_PATH;
+    argv[1] = id_buf;
+    argv[2] = run_name;
+    argv[3] = nch_buf;
+    argv[4] = level_buf;
+    argv[5] = trace_path;
+    argv[6] = NULL;
+    
+    status = posix_spawn(&member->pid, CLIENT_PATH, NULL, NULL, argv, environ);
+    if(status) {
+        errno = status;
+        perror("Failed to create station process.");
+        exit(EXIT_FAILURE);
+    }
+    spawned++;
+    return member;
+}
+
+/*
+ Spawn n clients back to back, then wait once for all of them at the
+ readiness barrier. A client that dies before checking in is fatal.
+ */
+void pool_grow(int n)
+{
+    int i, status;
+    uint32_t seen;
+    member_s *member;
+    
+    for(i = 0; i < n; i++) {
+        member = pool_spawn();
+        member->next = pool;
+        pool = member;
+        pool_idle++;
+    }
+    
+    while((seen = __atomic_load_n(&ready->count, __ATOMIC_ACQUIRE)) < spawned) {
+        shm_wait(&ready->count, seen, &ready->waiters, spin_budget, READY_TIMEOUT);
+        for(i = 0, member = pool; i < n; i++, member = member->next) {
+            if(waitpid(member->pid, &status, WNOHANG) == member->pid) {
+                fprintf(stderr, "Station process %d exited during start-up\n", (int)member->pid);
+                exit(EXIT_FAILURE);
+            }
         }
-        else {
-            status = execv(CLIENT_PATH, argv);
+    }
+}
+
+member_s *pool_take(void)
+{
+    member_s *member;
+    
+    if(pool_reserved)
+        pool_reserved--;
+    else if(pool)
+        pool_hits++;
+    else {
+        pool_misses++;
+        pool_grow(1);
+    }
+    member = pool;
+    pool = member->next;
+    pool_idle--;
+    return member;
+}
+
+/* Strip the station identity and keep the process if the pool has room */
+void pool_return(member_s *member)
+{
+    cmd_s cmd = {.func = FNET_KILL};
+    
+    if(pool_idle >= pool_size) {
+        member_terminate(member);
+        return;
+    }
+    mailbox_append(member, &cmd, NULL);
+    member->next = pool;
+    pool = member;
+    pool_idle++;
+    pool_returns++;
+}
+
+/* Warm the pool at start-up, with room for the script's own nodes */
+void pool_fill(void)
+{
+    int n = queued_nodes();
+    
+    if(n < pool_size)
+        n = pool_size;
+    if(pool_idle < n)
+        pool_grow(n - pool_idle);
+}
+
+void pool_drain(void)
+{
+    member_s *member;
+    
+    while((member = pool)) {
+        pool = member->next;
+        member_terminate(member);
+    }
+    pool_idle = 0;
+}
+
+void member_terminate(member_s *member)
+{
+    /* nothing left on the outbox may point at it */
+    mailbox_flush();
+    kill(member->pid, SIGTERM);
+    munmap(member->mailbox, medium_bytes(member->mailbox->capacity));
+    free(member);
+}
+
+/*
+ Add a command to the bundle this member's mailbox slot is collecting.
+ The slot is published by mailbox_flush, or early if it fills up. The
+ client drains its mailbox continuously, so a full ring only means
+ waiting briefly.
+ */
+void mailbox_append(member_s *member, cmd_s *cmd, char **fields)
+{
+    int i;
+    size_t size = sizeof(*cmd);
+    cmd_s *rec;
+    medium_s *box = member->mailbox;
+    
+    for(i = 0; i < CMD_FIELDS; i++)
+        size += cmd->len[i];
+    size = (size + CMD_ALIGN-1) & ~(size_t)(CMD_ALIGN-1);
+    if(size > box->capacity) {
+        logevent("Command of %zu bytes exceeds mailbox capacity %zu", size, box->capacity);
+        return;
+    }
+    
+    if(member->slot && member->slot->size + size > box->capacity) {
+        medium_publish(box, member->slot, member->pos, member->slot->size);
+        member->slot = NULL;
+    }
+    if(!member->slot) {
+        while(!(member->slot = medium_claim(box, &member->pos)))
+            nanosleep(&mailbox_retry, NULL);
+        member->slot->size = 0;
+        if(!member->queued) {
+            member->queued = true;
+            member->outbox = outbox;
+            outbox = member;
         }
     }
-    pthread_mutex_unlock(&station_table_lock);
+    
+    rec = (cmd_s *)&member->slot->data[member->slot->size];
+    *rec = *cmd;
+    rec->size = size;
+    size = sizeof(*cmd);
+    for(i = 0; i < CMD_FIELDS; i++) {
+        if(!cmd->len[i])
+            continue;
+        memcpy((char *)rec + size, fields[i], cmd->len[i]);
+        size += cmd->len[i];
+    }
+    member->slot->size += rec->size;
+}
+
+/* Publish every open bundle, one doorbell per client */
+void mailbox_flush(void)
+{
+    member_s *member;
+    
+    while((member = outbox)) {
+        outbox = member->outbox;
+        member->queued = false;
+        if(member->slot) {
+            medium_publish(member->mailbox, member->slot, member->pos, member->slot->size);
+            member->slot = NULL;
+        }
+    }
+}
+
+/* Host a station in this process as a MAC and a receive coroutine */
+/* node(..., seed=n) replaces the run seed for that one station */
+uint64_t station_seed(char *id, char *seed)
+{
+    return rng_mix(seed ? strtoull(seed, NULL, 0) : run_seed, id);
+}
+
+void create_local_node(station_s *station, char *id, char *ifs, uint64_t seed)
+{
+    FILE *log;
+    char outfile[SHM_NAME_SIZE];
+    channel_s *ch = &channels[station->channel];
+    
+    snprintf(outfile, sizeof(outfile), "out/%s", station->addr);
+    log = fopen(outfile, "w");
+    if(!log) {
+        perror("Error Creating file for redirection");
+        exit(EXIT_FAILURE);
+    }
+    
+    station->mac = alloc(sizeof(*station->mac));
+    mac_init(station->mac, station->addr, strtod(ifs, NULL), seed, log);
+    station->mac->id = station->id;
+    station->mac->stats = &stats->stations[station->id];
+    station->mac->mediums = ch->mediums;
+    station->mac->mediumc = ch->mediumc;
+    station->mac->inbox = station->inbox;
+    mac_hold(station->mac);
+    mac_hold(station->mac);
+    co_spawn(station_receive, station->mac, station->id);
+    co_spawn(station_run, station->mac, station->id);
+    
+    sym_insert(&station_table, id, (sym_data_u){.ptr = station});
+    pthread_rwlock_wrlock(&addr_table_lock);
+    sym_insert(&addr_table, station->addr, (sym_data_u){.ptr = station});
+    pthread_rwlock_unlock(&addr_table_lock);
+    printf("Successfully Started Station: %s\n", id);
+}
+
+void station_run(void *arg)
+{
+    mac_run(arg);
+}
+
+void station_receive(void *arg)
+{
+    mac_receive(arg);
 }
 
 void send_message(send_s *send)
 {
     sym_record_s *rec;
     station_s *station;
-    size_t dlen, plen;
+    cmd_s cmd = {.func = FNET_SEND};
+    char *fields[CMD_FIELDS];
     
-    pthread_mutex_lock(&station_table_lock);
     rec = sym_lookup(&station_table, send->src);
     if(rec) {
-        dlen = strlen(send->dst);
-        plen = strlen(send->period);
         station = rec->data.ptr;
-        write(station->pipe[1], &send->super.func, sizeof(send->super.func));
-        write(station->pipe[1], &dlen, sizeof(dlen));
-        write(station->pipe[1], send->dst, strlen(send->dst));
-        write(station->pipe[1], &send->size, sizeof(send->size));
-        write(station->pipe[1], send->payload, send->size);
-        write(station->pipe[1], &plen, sizeof(plen));
-        write(station->pipe[1], send->period, plen);
-        write(station->pipe[1], &send->repeat, sizeof(send->repeat));
-        kill(station->pid, SIGUSR1);
+        if(send->size + sizeof(uint32_t) > medium_capacity) {
+            fprintf(stderr, "Send from %s: payload of %zu bytes exceeds medium capacity %zu\n",
+                    send->src, send->size, medium_capacity);
+            return;
+        }
+        if(station->mac) {
+            mac_submit(station->mac, msg_new(station->mac, send->dst, send->payload, send->size,
+                                             send->period, send->repeat));
+            return;
+        }
+        cmd.repeat = send->repeat;
+        cmd.len[0] = strlen(send->dst) + 1;
+        cmd.len[1] = send->size;
+        cmd.len[2] = strlen(send->period) + 1;
+        fields[0] = send->dst;
+        fields[1] = send->payload;
+        fields[2] = send->period;
+        mailbox_append(station->member, &cmd, fields);
     }
-    pthread_mutex_unlock(&station_table_lock);
 }
 
 void kill_child(station_s *s)
 {
-    close(s->pipe[0]);
-    close(s->pipe[1]);
-    kill(s->pid, SIGTERM);
+    int c;
+    
+    __atomic_store_n(&stats->stations[s->id].active, 0, __ATOMIC_RELEASE);
+    pthread_rwlock_wrlock(&addr_table_lock);
+    sym_delete(&addr_table, s->addr);
+    pthread_rwlock_unlock(&addr_table_lock);
+    
+    /* a request thread may have looked it up before it was removed */
+    if(!s->epochs)
+        s->epochs = alloc(nchannels*sizeof(*s->epochs));
+    for(c = 0; c < nchannels; c++)
+        s->epochs[c] = __atomic_load_n(&channels[c].epoch, __ATOMIC_ACQUIRE);
+    s->next = NULL;
+    *retired_tail = s;
+    retired_tail = &s->next;
+    
+    if(s->mac) {
+        /* its coroutines notice and drop their references */
+        mac_stop(s->mac);
+        mac_release(s->mac);
+        s->mac = NULL;
+        return;
+    }
+    pool_return(s->member);
+    s->member = NULL;
+}
+
+/*
+ Take the first retired station whose id is free to use again, with
+ its stats slot cleared. The access delay it recorded is kept for the
+ report at exit.
+ */
+station_s *station_reuse(void)
+{
+    station_s *s, **prev;
+    station_stats_s *st;
+    int i;
+    
+    for(prev = &retired; (s = *prev); prev = &s->next)
+        if(station_idle(s))
+            break;
+    if(!s)
+        return NULL;
+    *prev = s->next;
+    if(!*prev)
+        retired_tail = prev;
+    
+    st = &stats->stations[s->id];
+    if(!retired_latency)
+        retired_latency = allocz(sizeof(*retired_latency));
+    for(i = 0; i < LAT_STAGES; i++)
+        hist_merge(&retired_latency->stage[i], &st->latency.stage[i]);
+    memset(st, 0, sizeof(*st));
+    return s;
+}
+
+/*
+ A killed station's inbox is quiet once its MAC has let go of it and
+ every request thread has gone round its loop since the kill.
+ */
+bool station_idle(station_s *s)
+{
+    int c;
+    
+    if(__atomic_load_n(&stats->stations[s->id].attached, __ATOMIC_ACQUIRE))
+        return false;
+    for(c = 0; c < nchannels; c++)
+        if(__atomic_load_n(&channels[c].epoch, __ATOMIC_ACQUIRE) <= s->epochs[c])
+            return false;
+    return true;
 }
 
 void kill_childid(char *id)
 {
     sym_record_s *rec;
     
-    pthread_mutex_lock(&station_table_lock);
     rec = sym_lookup(&station_table, id);
     if(rec) {
         kill_child(rec->data.ptr);
         sym_delete(&station_table, id);
     }
-    pthread_mutex_unlock(&station_table_lock);
 }
 
 void *process_request(void *arg)
 {
+    channel_s *ch = arg;
+    channel_stats_s *st = &stats->channels[ch->id];
     ssize_t status;
     union {
         rts_s rts;
         cts_ack_s ctack;
     }data;
     char *payload;
-    uint32_t checksum, *checkptr;
+    uint32_t checksum;
+    uint64_t cursor = medium_mark(ch->mediums), pos, rts_ns;
+    size_t size;
+    medium_s *inbox;
+    slot_s *slot;
+    bool aggregate;
     
     while(true) {
-        status = slowread(mediums, &data, sizeof(data));
-        mediums->size = 0;
+        __atomic_store_n(&ch->epoch, ch->epoch + 1, __ATOMIC_RELEASE);
+        status = medium_read(ch->mediums, &cursor, &data, sizeof(data));
+        medium_consume(ch->mediums, cursor);
         if(status == EINTR) {
-            set_busy(mediums, false);
-            logevent("Timed out session");
+            set_busy(ch->mediums, false);
+            logat(LOG_INFO, "Timed out session");
+            stat_inc(st->timeouts);
+            trace_emit(TRACE_AP_TIMEOUT, TRACE_AP, NULL, ch->id, 0, 0);
         }
         else {
-            set_busy(mediums, true);
+            set_busy(ch->mediums, true);
             if(data.rts.FC & RTS_SUBTYPE) {
-                checksum = (uint32_t)crc32(CRC_POLYNOMIAL, (Bytef *)&data.rts, sizeof(data.rts)-sizeof(uint32_t));
+                checksum = crc32c(&data.rts, sizeof(data.rts)-sizeof(uint32_t));
                 if(checksum == data.rts.FCS) {
-                    send_ack_cts(data.rts.addr1, CTS_SUBTYPE);
-                    payload = alloc(data.rts.D+sizeof(uint32_t));
-                    status = slowread(mediums, payload, data.rts.D + sizeof(uint32_t));
-                    mediums->size = 0;
+                    rts_ns = clock_ns();
+                    send_ack_cts(ch, data.rts.addr1, CTS_SUBTYPE);
+                    
+                    /* receive straight into the destination's inbox when it fits */
+                    size = data.rts.D + sizeof(uint32_t);
+                    inbox = station_inbox(data.rts.addr2);
+                    aggregate = data.rts.FC & FC_AGGREGATE;
+                    slot = NULL;
+                    if(!aggregate && inbox && ADDR_SIZE + size <= inbox->capacity)
+                        slot = medium_claim(inbox, &pos);
+                    payload = slot ? slot->data + ADDR_SIZE : alloc(size);
+                    
+                    /* the FCS is checked while the payload is copied in */
+                    status = medium_read_fcs(ch->mediums, &cursor, payload, size);
+                    medium_consume(ch->mediums, cursor);
                     if(status == EINTR) {
-                        logevent("timed out waiting on payload");
+                        logat(LOG_INFO, "timed out waiting on payload");
+                        stat_inc(st->payload_timeouts);
+                        trace_emit(TRACE_AP_TIMEOUT, TRACE_AP, data.rts.addr1, ch->id, 0, data.rts.D);
+                        size = 0;
                     }
-                    else {
-                        checksum = (uint32_t)crc32(CRC_POLYNOMIAL, (Bytef *)payload, data.rts.D);
-                        checkptr = (uint32_t *)&payload[data.rts.D];
-                        if(checksum == *checkptr) {
-                            deliver_message(data.rts.addr1, data.rts.addr2, payload, data.rts.D);
-                            send_ack_cts(data.rts.addr1, ACK_SUBTYPE);
+                    else if(status == EBADMSG || status == EMSGSIZE) {
+                        logevent("Checksum Validation FAiled for payload");
+                        stat_inc(st->payload_fcs);
+                        trace_emit(TRACE_FCS_ERROR, TRACE_AP, data.rts.addr1, ch->id, 0, data.rts.D);
+                        size = 0;
+                    }
+                    else if(aggregate && inbox) {
+                        status = deliver_aggregate(ch, inbox, data.rts.addr1, payload, data.rts.D);
+                        if(!status) {
+                            logat(LOG_DEBUG, "Delivered aggregate to %.6s", data.rts.addr2);
+                            trace_emit(TRACE_DELIVER, TRACE_AP, data.rts.addr1, ch->id, 0, data.rts.D);
+                            hist_record(&st->delivery, clock_ns() - rts_ns);
+                            send_ack_cts(ch, data.rts.addr1, ACK_SUBTYPE);
+                        }
+                        else if(status == EBADMSG) {
+                            /* not acked, same as a payload that failed its FCS */
+                            stat_inc(st->payload_fcs);
+                            trace_emit(TRACE_FCS_ERROR, TRACE_AP, data.rts.addr1, ch->id, 0, data.rts.D);
                         }
                         else {
-                            logevent("Checksum Validation FAiled for payload");
+                            logevent("Inbox full for %.6s", data.rts.addr2);
                         }
                     }
-                    free(payload);
+                    else if(slot) {
+                        memcpy(slot->data, data.rts.addr1, ADDR_SIZE);
+                        size = ADDR_SIZE + data.rts.D;
+                        ch->delivered++;
+                        ch->bytes += data.rts.D;
+                        logat(LOG_DEBUG, "Delivered payload to %.6s", data.rts.addr2);
+                        trace_emit(TRACE_DELIVER, TRACE_AP, data.rts.addr1, ch->id, 0, data.rts.D);
+                        hist_record(&st->delivery, clock_ns() - rts_ns);
+                        send_ack_cts(ch, data.rts.addr1, ACK_SUBTYPE);
+                    }
+                    else if(inbox) {
+                        /* no ACK, the sender will retry once the station catches up */
+                        logevent("Inbox full for %.6s", data.rts.addr2);
+                    }
+                    else {
+                        logevent("Unknown Station: %.6s", data.rts.addr2);
+                        send_ack_cts(ch, data.rts.addr1, ACK_SUBTYPE);
+                    }
+                    if(slot)
+                        medium_publish(inbox, slot, pos, size);
+                    else
+                        free(payload);
                 }
                 else {
                     logevent("Checksum Validation Failed for suspected RTS");
+                    stat_inc(st->rts_fcs);
+                    trace_emit(TRACE_FCS_ERROR, TRACE_AP, NULL, ch->id, 0, 0);
                 }
             }
             else {
                 logevent("Unknown traffic type received");
+                stat_inc(st->unknown);
             }
-            set_busy(mediums, false);
+            set_busy(ch->mediums, false);
         }
     }
 }
 
-void send_ack_cts(char *addr1, int type)
+void send_ack_cts(channel_s *ch, char *addr1, int type)
 {
     cts_ack_s ack_cts;
     
     ack_cts.FC = type;
     ack_cts.D = 1;
     memcpy(ack_cts.addr1, addr1, sizeof(ack_cts.addr1));
-    ack_cts.FCS = (uint32_t)crc32(CRC_POLYNOMIAL, (Bytef *)&ack_cts, sizeof(ack_cts)-sizeof(uint32_t));
-    slowwrite(mediumc, &ack_cts, sizeof(ack_cts));
-    logevent("Got Valid RTS and Sent ACK");
+    ack_cts.FCS = crc32c(&ack_cts, sizeof(ack_cts)-sizeof(uint32_t));
+    medium_write(ch->mediumc, &ack_cts, sizeof(ack_cts));
+    logat(LOG_DEBUG, "Got Valid RTS and Sent ACK");
 }
 
-void deliver_message(char *addr1, char *addr2, char *payload, size_t size)
+medium_s *station_inbox(char *addr)
 {
     sym_record_s *rec;
-    station_s *station;
-    funcs_e func = FNET_RECEIVE;
-    char addbuf[9];
+    medium_s *inbox = NULL;
+    char key[ADDR_SIZE+1] = {0};
     
-    addbuf[0] = '"';
-    strncpy(&addbuf[1], addr2, 6);
-    addbuf[strlen(addbuf)] = '"';
-    addbuf[strlen(addbuf)] = '\0';
+    strncpy(key, addr, ADDR_SIZE);
     
-    pthread_mutex_lock(&station_table_lock);
-    rec = sym_lookup(&station_table, addbuf);
-    if(rec) {
-        station = rec->data.ptr;
-        write(station->pipe[1], &func, sizeof(func));
-        write(station->pipe[1], &size, sizeof(size));
-        write(station->pipe[1], payload, size);
-        write(station->pipe[1], addr1, 6);
-        kill(station->pid, SIGUSR1);
-        logevent("Delivered payload to %.6s", addr2);
+    pthread_rwlock_rdlock(&addr_table_lock);
+    rec = sym_lookup(&addr_table, key);
+    if(rec)
+        inbox = ((station_s *)rec->data.ptr)->inbox;
+    pthread_rwlock_unlock(&addr_table_lock);
+    
+    return inbox;
+}
+
+/* Payloads acked by the AP per channel and in total, for saturation runs */
+void goodput_report(double elapsed)
+{
+    int c;
+    uint64_t delivered = 0, bytes = 0;
+    
+    for(c = 0; c < nchannels; c++) {
+        if(nchannels > 1)
+            logevent("Channel %d goodput: %.3f frames/s, %.3f kbit/s", c,
+                     channels[c].delivered/elapsed, channels[c].bytes*8e-3/elapsed);
+        delivered += channels[c].delivered;
+        bytes += channels[c].bytes;
     }
-    else
-        logevent("Unknown Station: %.6s", addr2);
-    pthread_mutex_unlock(&station_table_lock);
+    logevent("Goodput: %.3f frames/s, %.3f kbit/s (%llu frames, %llu bytes in %.3f s)",
+             delivered/elapsed, bytes*8e-3/elapsed,
+             (unsigned long long)delivered, (unsigned long long)bytes, elapsed);
+    printf("Goodput: %.3f frames/s, %.3f kbit/s over %.3f s\n", delivered/elapsed, bytes*8e-3/elapsed, elapsed);
+}
+
+/*
+ Access delay over every station, merged from their histograms in the
+ stats segment, and the time from RTS to delivery per channel and over
+ all of them.
+ */
+void latency_report(void)
+{
+    static const char *stages[LAT_STAGES] = {"RTS", "CTS", "ACK"};
+    char line[256];
+    hist_s *all = allocz(sizeof(*all));
+    int i, c;
+    
+    for(i = 0; i < LAT_STAGES; i++) {
+        memset(all, 0, sizeof(*all));
+        for(c = 0; c < nstations; c++)
+            hist_merge(all, &stats->stations[c].latency.stage[i]);
+        if(retired_latency)
+            hist_merge(all, &retired_latency->stage[i]);
+        hist_format(all, line, sizeof(line));
+        logevent("Delay to %s: %s", stages[i], line);
+    }
+    
+    memset(all, 0, sizeof(*all));
+    for(c = 0; c < nchannels; c++) {
+        if(nchannels > 1) {
+            hist_format(&stats->channels[c].delivery, line, sizeof(line));
+            logevent("Channel %d RTS to delivery: %s", c, line);
+        }
+        hist_merge(all, &stats->channels[c].delivery);
+    }
+    hist_format(all, line, sizeof(line));
+    logevent("RTS to delivery: %s", line);
+    free(all);
+}
 
+uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
 }
 
-void sigUSR1(int sig){}
+/*
+ Split an aggregate into the inbox, one slot per payload. Every slot
+ is claimed before any is filled so the aggregate is delivered whole
+ or, with no ACK, not at all. Returns ENOBUFS if the inbox is full and
+ EBADMSG if the aggregate does not parse into 1 to AGG_MAX payloads
+ that end exactly at its end.
+ */
+int deliver_aggregate(channel_s *ch, medium_s *inbox, char *src, char *payload, size_t size)
+{
+    slot_s *slots[AGG_MAX];
+    uint64_t pos[AGG_MAX];
+    uint16_t lens[AGG_MAX];
+    char *frames[AGG_MAX];
+    size_t off = 0;
+    int i, n = 0;
+    
+    /* off only moves past payloads that check out, so any break leaves it short of size */
+    while(off < size) {
+        if(n == AGG_MAX || n >= inbox->nslots || off + AGG_HEADER > size)
+            break;
+        memcpy(&lens[n], payload + off, AGG_HEADER);
+        if(off + AGG_HEADER + lens[n] > size || ADDR_SIZE + lens[n] > inbox->capacity)
+            break;
+        frames[n] = payload + off + AGG_HEADER;
+        off += AGG_HEADER + lens[n];
+        n++;
+    }
+    if(off != size || !n) {
+        logevent("Malformed aggregate from %.6s", src);
+        return EBADMSG;
+    }
+    
+    for(i = 0; i < n; i++) {
+        slots[i] = medium_claim(inbox, &pos[i]);
+        if(!slots[i])
+            break;
+    }
+    if(i < n) {
+        while(i--)
+            medium_publish(inbox, slots[i], pos[i], 0);
+        return ENOBUFS;
+    }
+    
+    for(i = 0; i < n; i++) {
+        memcpy(slots[i]->data, src, ADDR_SIZE);
+        memcpy(slots[i]->data + ADDR_SIZE, frames[i], lens[i]);
+        medium_publish(inbox, slots[i], pos[i], ADDR_SIZE + lens[i]);
+        ch->delivered++;
+        ch->bytes += lens[i];
+    }
+    return 0;
+}
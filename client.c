@@ -7,78 +7,65 @@
 #include <assert.h>
 #include <errno.h>
 
-#include <zlib.h>
 #include <signal.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
 
 #include <sys/types.h>
-#include <sys/ipc.h>
-#include <sys/shm.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "shared.h"
+#include "station.h"
+#include "trace.h"
 
 #define REDIRECT_OUTPUT
 
 #define TIMER_TIME 0.5
 
-typedef struct send_s send_s;
+static mac_s *mac;
+static char *run;
+static ready_s *ready;
+static stats_s *stats;
+static medium_s *uplinks[MAX_CHANNELS];
+static medium_s *downlinks[MAX_CHANNELS];
+static medium_s *mailbox;
+static pthread_t inbox_thread;
+static pthread_t mac_thread;
+static int terminated;
 
-struct send_s
-{
-    pthread_t thread;
-    size_t dlen;
-    char *dst;
-    size_t size;
-    char *payload;
-    size_t plen;
-    char *period;
-    bool repeat;
-};
-
-static int tasks[2];
-static int shm_mediums;
-static int shm_mediumc;
-static struct timespec ifs;
-static pthread_t main_thread;
-static volatile sig_atomic_t pipe_full;
-
-static void parse_send(void);
-static void parse_receive(void);
-static void *send_thread(void *arg);
-static void doCSMACA(send_s *s);
-static void sendRTS(send_s *s);
-static void send_frame(send_s *s);
-static bool check_ack_cts(cts_ack_s *data);
+static void parse_node(cmd_s *cmd);
+static void parse_kill(void);
+static void parse_send(cmd_s *cmd);
+static void *receive_thread(void *arg);
+static void *run_thread(void *arg);
 
-static void sigUSR1(int sig);
 static void sigTERM(int sig);
 
 int main(int argc, char *argv[])
 {
-    int status;
-    funcs_e f;
-    ssize_t rstatus;
-    double ifs_d;
+    int status, channel, nchannels;
+    char shm[SHM_NAME_SIZE];
+    uint64_t cursor = 0;
+    uint32_t seen;
+    size_t off;
+    slot_s *slot;
+    cmd_s *cmd;
     struct sigaction sa;
-    char outfile[16] = "out/";
     
-    if(argc != 4) {
-        fprintf(stderr, "Client expects 3 parameters. Only received %d.\n", argc);
+    if(argc != 6) {
+        fprintf(stderr, "Client expects 5 parameters. Only received %d.\n", argc-1);
         exit(EXIT_FAILURE);
     }
-
-    name = argv[1];
-    name_len = strlen(name);
     
-    /* Strip out quotes from node name and initialize it */
-    name_stripped = alloc(name_len - 2);
-    strncpy(name_stripped, &name[1], name_len-2);
+    /* log to stderr until the AP gives this process a station */
+    name = name_stripped = "pool";
+    name_len = strlen(name);
+    logfile = stderr;
     
-    /* Create file for logging */
+    /* Create directory for station logs */
     if(access("out/", F_OK)) {
         if(errno == ENOENT)
             mkdir("out", S_IRWXU);
@@ -88,35 +75,15 @@ int main(int argc, char *argv[])
         }
     }
     
-    strcpy(&outfile[4], name_stripped);
-    logfile = fopen(outfile, "w");
-    if(!logfile) {
-        perror("Error Creating file for redirection");
-        exit(EXIT_FAILURE);
-    }
-    
-    /* set ifs time for this station */
-    ifs_d = strtod(argv[2], NULL);
-    ifs.tv_sec = (long)ifs_d;
-    ifs.tv_nsec = (long)((ifs_d - ifs.tv_sec)*1e9);
+    run = argv[2];
+    nchannels = atoi(argv[3]);
+    log_level = atoi(argv[4]);
     
-    /* get thread 'id' */
-    main_thread = pthread_self();
+    /* the AP passes an empty path when it isn't tracing */
+    if(*argv[5])
+        trace_attach(argv[5]);
     
-    /* Get pipes so this process can communicate with command line process */
-    sscanf(argv[3], "%d.%d", &tasks[0], &tasks[1]);
-    
-    /* Set up handler for SIGUSR1 */
-    sa.sa_handler = sigUSR1;
-    sa.sa_flags = SA_RESTART;
-    sigemptyset(&sa.sa_mask);
-    status = sigaction(SIGUSR1, &sa, NULL);
-    if(status < 0) {
-        perror("Error installing handler for SIGUSR1");
-        exit(EXIT_FAILURE);
-    }
-
-    /* Handler for releasing some resources on SIGTERM */
+    /* SIGTERM only asks the command loop below to wind the station down */
     sa.sa_handler = sigTERM;
     sa.sa_flags = SA_RESTART;
     sigemptyset(&sa.sa_mask);
@@ -136,258 +103,182 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
     
-    /* Shared memory used for medium to send to access point */
-    shm_mediums = shmget(SHM_KEY_S, sizeof(char), SHM_R);
-    if(shm_mediums < 0) {
-        perror("Failed to locate shared memory segment.");
-        exit(EXIT_FAILURE);
-    }
-    
-    mediums = shmat(shm_mediums, NULL, 0);
-    if(mediums == (medium_s *)-1) {
-        perror("Failed to attached shared memory segment.");
-        exit(EXIT_FAILURE);
+    /* Map every channel up front so any of them can be assigned later */
+    for(channel = 0; channel < nchannels; channel++) {
+        shm_name(shm, run, 's', channel);
+        uplinks[channel] = shm_attach(shm);
+        shm_name(shm, run, 'c', channel);
+        downlinks[channel] = shm_attach(shm);
     }
     
-    /* Shared memory used for medium to receive from access point */
-    shm_mediumc = shmget(SHM_KEY_C, sizeof(char), SHM_R);
-    if(shm_mediumc < 0) {
-        perror("Failed to locate shared memory segment.");
-        exit(EXIT_FAILURE);
-    }
-    
-    mediumc = shmat(shm_mediumc, NULL, 0);
-    if(mediumc == (medium_s *)-1) {
-        perror("Failed to attached shared memory segment.");
-        exit(EXIT_FAILURE);
-    }
-    
-    printf("Successfully Started Station: %s\n", name);
-    
-    /* Notify parent process */
-    kill(getppid(), SIGUSR1);
-    
-    /* Wait for commands from command line process */
+    /* Commands from the command line process arrive here */
+    shm_name(shm, run, 'q', atoi(argv[1]));
+    mailbox = shm_attach(shm);
+    
+    /* every station this process takes on counts into its slot here */
+    shm_name(shm, run, STATS_KIND, 0);
+    stats = shm_attach(shm);
+    
+    /* Check in at the AP's start-up barrier */
+    shm_name(shm, run, 'r', 0);
+    ready = shm_attach(shm);
+    __atomic_add_fetch(&ready->count, 1, __ATOMIC_RELEASE);
+    shm_wake(&ready->count, &ready->waiters);
+    
+    /*
+     Wait for commands from command line process. An idle client sleeps
+     on the doorbell with no timeout, and each bundle is handled in its
+     slot before the slot is handed back. terminated is checked after
+     the doorbell is read, as sigTERM rings it once the flag is set.
+     */
     while(true) {
-        if(pipe_full) {
-            rstatus = read(tasks[0], &f, sizeof(f));
-            if(rstatus < sizeof(f)) {
-                if(rstatus == EAGAIN) {
-                    pipe_full = 0;
-                }
-            }
-            else {
-                switch(f) {
-                    case FNET_SEND:
-                        parse_send();
-                        break;
-                    case FNET_RECEIVE:
-                        parse_receive();
-                        break;
-                    default:
-                        fprintf(stderr, "Unknown Data Type Send %d\n", f);
-                        break;
-                }
-            }
+        seen = __atomic_load_n(&mailbox->size, __ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&terminated, __ATOMIC_ACQUIRE))
+            break;
+        slot = medium_peek(mailbox, cursor);
+        if(!slot) {
+            shm_wait(&mailbox->size, seen, &mailbox->size_waiters, mailbox->spin, 0);
+            continue;
         }
-        else {
-            pause();
+        for(off = 0; off < slot->size; off += cmd->size) {
+            cmd = (cmd_s *)&slot->data[off];
+            switch(cmd->func) {
+                case FNET_NODE:
+                    parse_node(cmd);
+                    break;
+                case FNET_KILL:
+                    parse_kill();
+                    break;
+                case FNET_SEND:
+                    parse_send(cmd);
+                    break;
+                default:
+                    fprintf(stderr, "Unknown Data Type Send %d\n", cmd->func);
+                    break;
+            }
         }
+        medium_consume(mailbox, ++cursor);
+    }
+    
+    /* drop the station the same way as on kill(), so the AP can reuse its id */
+    if(mac) {
+        timer_report();
+        parse_kill();
     }
-
     exit(EXIT_SUCCESS);
 }
 
-/* 
- Parses a message from command line process
- that creates a sending thread. 
- */
-void parse_send(void)
+/* Takes on the station identity the AP assigns to this process */
+void parse_node(cmd_s *cmd)
 {
     int status;
-    send_s *s = alloc(sizeof(*s));
-    
-    read(tasks[0], &s->dlen, sizeof(s->dlen));
-    
-    s->dst = alloc(s->dlen+1);
-    s->dst[s->dlen] = '\0';
-    read(tasks[0], s->dst, s->dlen);
+    char outfile[SHM_NAME_SIZE] = "out/";
+    char shm[SHM_NAME_SIZE];
+    FILE *log;
     
-    read(tasks[0], &s->size, sizeof(s->size));
-    s->payload = alloc(s->size+sizeof(uint32_t)+1);
-    s->payload[s->size] = '\0';
-    read(tasks[0], s->payload, s->size);
-    
-    read(tasks[0], &s->plen, sizeof(s->plen));
-    s->period = alloc(s->plen+1);
-    s->period[s->plen] = '\0';
-    read(tasks[0], s->period, s->plen);
+    name = strdup(cmd->data);
+    name_len = strlen(name);
     
-    read(tasks[0], &s->repeat, sizeof(s->repeat));
+    /* Strip out quotes from node name */
+    name_stripped = allocz(name_len - 1);
+    strncpy(name_stripped, &name[1], name_len-2);
     
-    status = pthread_create(&s->thread, NULL, send_thread, s);
+    strncat(outfile, name_stripped, sizeof(outfile) - sizeof("out/"));
+    log = fopen(outfile, "w");
+    if(!log) {
+        perror("Error Creating file for redirection");
+        exit(EXIT_FAILURE);
+    }
+    logfile = log;
+    
+    mac = alloc(sizeof(*mac));
+    mac_init(mac, name_stripped, strtod(&cmd->data[cmd->len[0]], NULL),
+             strtoull(&cmd->data[cmd->len[0] + cmd->len[1]], NULL, 10), log);
+    mac->id = cmd->id;
+    mac->stats = &stats->stations[cmd->id];
+    mediums = mac->mediums = uplinks[cmd->channel];
+    mediumc = mac->mediumc = downlinks[cmd->channel];
+    
+    /* Frames the access point delivers to this station */
+    shm_name(shm, run, 'i', cmd->id);
+    mac->inbox = shm_attach(shm);
+    mac_hold(mac);
+    status = pthread_create(&inbox_thread, NULL, receive_thread, mac);
     if(status) {
-        perror("Failed to create thread for sending.");
+        perror("Failed to create receive thread");
         exit(EXIT_FAILURE);
     }
-}
-
-/* Receive a message and display it */
-void parse_receive(void)
-{
-    size_t size;
-    char *payload;
-    char src[6];
-    
-    read(tasks[0], &size, sizeof(size));
-    
-    payload = alloc(size+1);
-    payload[size] = '\0';
     
-    read(tasks[0], payload, size);
-    read(tasks[0], src, sizeof(src));
-    
-    logevent("Received Message %s from %.6s", payload, src);
-    free(payload);
-}
-
-/* Thread For Proccesses Attempting to Send */
-void *send_thread(void *arg)
-{
-    send_s *s = arg;
-    struct timespec t;
-    double wait_d = strtod(s->period, NULL);
-    double actual;
-    
-    /* seed random number generator */
-    srand((int)time(NULL));
-    
-    do {
-        actual = wait_d * (double)rand()/(RAND_MAX);
-        t.tv_sec = (long)actual;
-        t.tv_nsec = (long)((actual - t.tv_sec)*1e9);
-        nanosleep(&t, NULL);
-        doCSMACA(s);
+    /* every send() of this station is transmitted by this one thread */
+    mac_hold(mac);
+    status = pthread_create(&mac_thread, NULL, run_thread, mac);
+    if(status) {
+        perror("Failed to create MAC thread");
+        exit(EXIT_FAILURE);
     }
-    while(s->repeat);
     
-    free(s->dst);
-    free(s->period);
-    free(s->payload);
-    free(s);
-        
-    pthread_exit(NULL);
+    printf("Successfully Started Station: %s\n", name);
 }
 
-/* Main CSMA/CA Function */
-void doCSMACA(send_s *s)
+/*
+ Drops the station identity and goes back to the pool once the MAC
+ thread has finished the exchange it was in.
+ */
+void parse_kill(void)
 {
-    ssize_t status;
-    struct timespec ts;
-    cts_ack_s ackcts;
-    int K = 0, R;
+    medium_s *inbox = mac->inbox;
     
-    while(K != 32) {
-        /* wait until idle and waste tons of cycles in the process */
-        while(mediums->isbusy)
-            sched_yield();
-        
-        /* wait ifs time */
-        nanosleep(&ifs, NULL);
-        
-        if(mediums->isbusy)
-            continue;
-        
-        /* pick random number between 0 and 2^K - 1 */
-        R = rand() % (1 << K);
-        
-        /* Send Request to send */
-        sendRTS(s);
-                
-        status = slowread(mediumc, &ackcts, sizeof(ackcts));
-        /* if not timed out timed out */
-        if(status != EINTR)
-        if(ackcts.FC & CTS_SUBTYPE) {
-            if(check_ack_cts(&ackcts)) {
-                mediumc->size = 0;
-                logevent("GOT CTS");
-                
-                /* wait ifs time */
-                nanosleep(&ifs, NULL);
-                                
-                send_frame(s);
-                status = slowread(mediumc, &ackcts, sizeof(ackcts));
-                if(status != EINTR)
-                if(ackcts.FC & ACK_SUBTYPE) {
-                    if(check_ack_cts(&ackcts)) {
-                        mediumc->size = 0;
-                        logevent("Got Ack");
-                        return;
-                    }
-                }
-            }
-            logevent("Timed out: K is now: %d and R is: %d", K, R);
-            K++;
-            ts.tv_nsec = R*TIME_SLOT;
-            ts.tv_sec = 0;
-            nanosleep(&ts, NULL);
-        }
-    }
-    logevent("Number of attempts exceeded 32");
+    mac_stop(mac);
+    pthread_join(inbox_thread, NULL);
+    pthread_join(mac_thread, NULL);
+    munmap(inbox, medium_bytes(inbox->capacity));
+    
+    logfile = stderr;
+    mac_release(mac);
+    mac = NULL;
+    free(name);
+    free(name_stripped);
+    name = name_stripped = "pool";
+    name_len = strlen(name);
 }
 
-/* Send Request To Send */
-void sendRTS(send_s *s)
+/* 
+ Parses a message from command line process
+ and queues it on the MAC thread. 
+ */
+void parse_send(cmd_s *cmd)
 {
-    rts_s frame = {0};
-    
-    frame.FC = RTS_SUBTYPE;
-    frame.D = s->size;
-    
-    memcpy(frame.addr1, name_stripped, name_len-2);
-    memcpy(frame.addr2, &s->dst[1], s->dlen-2);
+    char *dst = cmd->data;
+    char *payload = dst + cmd->len[0];
+    char *period = payload + cmd->len[1];
     
-    frame.FCS = (uint32_t)crc32(CRC_POLYNOMIAL, (Bytef *)&frame, sizeof(frame)-sizeof(uint32_t));
-    
-    slowwrite(mediums, &frame, sizeof(frame));
-    logevent("%s sent RTS", name_stripped);
+    mac_submit(mac, msg_new(mac, dst, payload, cmd->len[1], period, cmd->repeat));
 }
 
-/* Send Payload */
-void send_frame(send_s *s)
+void *receive_thread(void *arg)
 {
-    uint32_t *checkptr;
-    
-    checkptr = (uint32_t *)&s->payload[s->size];
-    *checkptr = (uint32_t)crc32(CRC_POLYNOMIAL, (Bytef *)s->payload, (int)s->size);
-     
-    slowwrite(mediums, s->payload, s->size + sizeof(uint32_t));
-    logevent("Sent Payload");
+    mac_receive(arg);
+    return NULL;
 }
 
-/* Check if CTS or ACK are valid */
-bool check_ack_cts(cts_ack_s *data)
+/* Thread that carries out this station's CSMA/CA */
+void *run_thread(void *arg)
 {
-    uint32_t checksum;
-    
-    if(addr_cmp(name_stripped, data->addr1)) {
-        checksum = (uint32_t)crc32(CRC_POLYNOMIAL, (Bytef *)data, sizeof(*data)-sizeof(uint32_t));
-        if(checksum == data->FCS)
-            return true;
-    }
-    return false;
+    mac_run(arg);
+    return NULL;
 }
 
 /* Signal Handlers */
 
-void sigUSR1(int sig)
-{
-    pipe_full = 1;
-}
-
+/*
+ The station may be half built or half torn down by the command loop,
+ so the handler only sets a flag and rings the mailbox doorbell.
+ */
 void sigTERM(int sig)
 {
-    free(name_stripped);
-    fclose(logfile);
-    exit(EXIT_SUCCESS);
+    __atomic_store_n(&terminated, 1, __ATOMIC_RELEASE);
+    if(mailbox) {
+        __atomic_fetch_add(&mailbox->size, 1, __ATOMIC_SEQ_CST);
+        shm_wake(&mailbox->size, &mailbox->size_waiters);
+    }
 }
@@ -0,0 +1,417 @@
+/* Coroutines on a small pool of worker threads, for in-process stations */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <signal.h>
+#include <sys/mman.h>
+
+#include "co.h"
+#include "shared.h"
+
+static co_worker_s *workers;
+static int nworkers;
+static co_bucket_s buckets[CO_WAIT_BUCKETS];
+
+static __thread co_worker_s *self_worker;
+static __thread co_s *current;
+
+static uint64_t clock_ns(void);
+static void *co_worker(void *arg);
+static void co_trampoline(void);
+static void co_switch(void);
+static void co_ctx_make(co_s *co);
+static co_bucket_s *co_bucket(uint32_t *word);
+static void co_ready(co_s *co);
+static void co_unpark(co_s *co);
+static void timer_push(co_worker_s *w, co_s *co);
+static void timer_remove(co_worker_s *w, co_s *co);
+static void timer_sift(co_worker_s *w, size_t i);
+
+#ifdef __x86_64__
+/*
+ Push the callee saved registers and the SSE and x87 control words,
+ save the stack pointer in *from and pop the same off the stack *to
+ points at. Unlike swapcontext the signal mask is left alone, so no
+ system call is made.
+ */
+extern void co_ctx_swap(co_ctx_t *from, co_ctx_t *to);
+__asm__(
+    ".text\n"
+    ".globl co_ctx_swap\n"
+    ".hidden co_ctx_swap\n"
+    ".type co_ctx_swap, @function\n"
+    "co_ctx_swap:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size co_ctx_swap, .-co_ctx_swap\n"
+);
+
+/* A stack co_ctx_swap pops into co_trampoline, with default control words */
+void co_ctx_make(co_s *co)
+{
+    uint64_t *sp = (uint64_t *)((char *)co->stack + CO_STACK_SIZE);
+    int i;
+    
+    *--sp = 0;
+    *--sp = (uint64_t)co_trampoline;
+    for(i = 0; i < 6; i++)
+        *--sp = 0;
+    *--sp = (uint64_t)0x037f << 32 | 0x1f80;
+    co->ctx = sp;
+}
+#else
+static void co_ctx_swap(co_ctx_t *from, co_ctx_t *to)
+{
+    swapcontext(from, to);
+}
+
+void co_ctx_make(co_s *co)
+{
+    getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack;
+    co->ctx.uc_stack.ss_size = CO_STACK_SIZE;
+    co->ctx.uc_link = NULL;
+    makecontext(&co->ctx, co_trampoline, 0);
+}
+#endif
+
+void co_init(int n)
+{
+    int i, status;
+    
+    for(i = 0; i < CO_WAIT_BUCKETS; i++)
+        pthread_mutex_init(&buckets[i].lock, NULL);
+    workers = allocz(n*sizeof(*workers));
+    for(i = 0; i < n; i++) {
+        pthread_mutex_init(&workers[i].lock, NULL);
+        workers[i].incoming_tail = &workers[i].incoming;
+        workers[i].ready_tail = &workers[i].ready;
+        status = pthread_create(&workers[i].thread, NULL, co_worker, &workers[i]);
+        if(status) {
+            perror("Failed to create coroutine worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+    __atomic_store_n(&nworkers, n, __ATOMIC_RELEASE);
+}
+
+/* Coroutines with the same hint share a worker and never run concurrently */
+void co_spawn(void (*fn)(void *), void *arg, unsigned hint)
+{
+    co_s *co = allocz(sizeof(*co));
+    co_worker_s *w = &workers[hint % nworkers];
+    
+    co->fn = fn;
+    co->arg = arg;
+    co->worker = w;
+    co->stack = mmap(NULL, CO_STACK_SIZE, PROT_READ|PROT_WRITE,
+                     MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_STACK, -1, 0);
+    if(co->stack == MAP_FAILED) {
+        perror("Failed to allocate coroutine stack");
+        exit(EXIT_FAILURE);
+    }
+    co_ctx_make(co);
+    
+    pthread_mutex_lock(&w->lock);
+    w->live++;
+    pthread_mutex_unlock(&w->lock);
+    co_ready(co);
+}
+
+/* NULL when called from an ordinary thread */
+co_s *co_self(void)
+{
+    return current;
+}
+
+/*
+ Park until *word != val, or for at most timeout seconds if not 0. The
+ word is checked again under its bucket's lock once the coroutine is
+ queued, so a co_wake that changed it first cannot be missed.
+ */
+void co_wait(uint32_t *word, uint32_t val, double timeout)
+{
+    co_s *co = current;
+    co_bucket_s *b = co_bucket(word);
+    
+    pthread_mutex_lock(&b->lock);
+    co->word = word;
+    co->queued = true;
+    co->wprev = NULL;
+    co->wnext = b->head;
+    if(b->head)
+        b->head->wprev = co;
+    __atomic_store_n(&b->head, co, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(__atomic_load_n(word, __ATOMIC_RELAXED) != val) {
+        co_unpark(co);
+        pthread_mutex_unlock(&b->lock);
+        co->word = NULL;
+        return;
+    }
+    pthread_mutex_unlock(&b->lock);
+    
+    if(timeout > 0) {
+        co->deadline = clock_ns() + (uint64_t)(timeout*1e9);
+        timer_push(co->worker, co);
+    }
+    co_switch();
+    co->word = NULL;
+}
+
+/*
+ Resume the coroutines parked on word. Called by shm_wake after every
+ change to a word anything may wait on; costs a fence and a load when
+ nothing is parked on the word's bucket.
+ */
+void co_wake(uint32_t *word)
+{
+    co_bucket_s *b;
+    co_s *co, *next, *woken = NULL;
+    
+    if(!__atomic_load_n(&nworkers, __ATOMIC_RELAXED))
+        return;
+    b = co_bucket(word);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if(!__atomic_load_n(&b->head, __ATOMIC_RELAXED))
+        return;
+    
+    pthread_mutex_lock(&b->lock);
+    for(co = b->head; co; co = next) {
+        next = co->wnext;
+        if(co->word == word) {
+            co_unpark(co);
+            co->next = woken;
+            woken = co;
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+    
+    /* kicking a worker goes through shm_wake, so not under the bucket lock */
+    for(co = woken; co; co = next) {
+        next = co->next;
+        co_ready(co);
+    }
+}
+
+void co_sleep(double secs)
+{
+    current->word = NULL;
+    current->deadline = clock_ns() + (uint64_t)(secs*1e9);
+    timer_push(current->worker, current);
+    co_switch();
+}
+
+void co_report(void)
+{
+    int i;
+    
+    for(i = 0; i < nworkers; i++)
+        logevent("Worker %d: %zu coroutines, %llu switches", i, workers[i].live,
+                 (unsigned long long)workers[i].switches);
+}
+
+uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+co_bucket_s *co_bucket(uint32_t *word)
+{
+    return &buckets[((uintptr_t)word >> 2)*0x9e3779b97f4a7c15ull >> 56 & (CO_WAIT_BUCKETS-1)];
+}
+
+/* Take a queued coroutine off its bucket; the bucket lock is held */
+void co_unpark(co_s *co)
+{
+    co_bucket_s *b = co_bucket(co->word);
+    
+    if(co->wprev)
+        co->wprev->wnext = co->wnext;
+    else
+        __atomic_store_n(&b->head, co->wnext, __ATOMIC_RELAXED);
+    if(co->wnext)
+        co->wnext->wprev = co->wprev;
+    co->queued = false;
+}
+
+/* Hand a coroutine to its worker from any thread */
+void co_ready(co_s *co)
+{
+    co_worker_s *w = co->worker;
+    
+    co->next = NULL;
+    pthread_mutex_lock(&w->lock);
+    *w->incoming_tail = co;
+    w->incoming_tail = &co->next;
+    pthread_mutex_unlock(&w->lock);
+    __atomic_fetch_add(&w->kick, 1, __ATOMIC_SEQ_CST);
+    shm_wake(&w->kick, &w->kick_waiters);
+}
+
+void co_switch(void)
+{
+    co_ctx_swap(&current->ctx, &self_worker->sched);
+}
+
+void co_trampoline(void)
+{
+    current->fn(current->arg);
+    current->done = true;
+    co_ctx_swap(&current->ctx, &self_worker->sched);
+}
+
+/* Deadline heap of one worker, only touched from that worker's thread */
+void timer_push(co_worker_s *w, co_s *co)
+{
+    if(w->ntimers == w->timers_size) {
+        w->timers_size = w->timers_size ? 2*w->timers_size : 64;
+        w->timers = ralloc(w->timers, w->timers_size*sizeof(*w->timers));
+    }
+    co->slot = w->ntimers++;
+    w->timers[co->slot] = co;
+    timer_sift(w, co->slot);
+}
+
+void timer_remove(co_worker_s *w, co_s *co)
+{
+    size_t i = co->slot;
+    
+    co->deadline = 0;
+    if(i != --w->ntimers) {
+        w->timers[i] = w->timers[w->ntimers];
+        w->timers[i]->slot = i;
+        timer_sift(w, i);
+    }
+}
+
+/* Move the entry at i up or down until the heap is ordered again */
+void timer_sift(co_worker_s *w, size_t i)
+{
+    co_s *co = w->timers[i];
+    size_t c;
+    
+    while(i > 0 && w->timers[(i-1)/2]->deadline > co->deadline) {
+        w->timers[i] = w->timers[(i-1)/2];
+        w->timers[i]->slot = i;
+        i = (i-1)/2;
+    }
+    while((c = 2*i + 1) < w->ntimers) {
+        if(c + 1 < w->ntimers && w->timers[c+1]->deadline < w->timers[c]->deadline)
+            c++;
+        if(w->timers[c]->deadline >= co->deadline)
+            break;
+        w->timers[i] = w->timers[c];
+        w->timers[i]->slot = i;
+        i = c;
+    }
+    w->timers[i] = co;
+    co->slot = i;
+}
+
+/*
+ Run what is ready, then move coroutines whose deadline has passed off
+ their buckets. With nothing to run the worker sleeps on kick until
+ the earliest deadline, or until a wake or spawn hands it one.
+ */
+void *co_worker(void *arg)
+{
+    co_worker_s *w = arg;
+    co_s *co, *ready;
+    uint64_t now;
+    uint32_t seen;
+    co_bucket_s *b;
+    sigset_t mask;
+    
+    /* the shutdown signal belongs to the main thread */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+    
+    self_worker = w;
+    while(true) {
+        seen = __atomic_load_n(&w->kick, __ATOMIC_ACQUIRE);
+        pthread_mutex_lock(&w->lock);
+        ready = w->incoming;
+        w->incoming = NULL;
+        w->incoming_tail = &w->incoming;
+        pthread_mutex_unlock(&w->lock);
+        for(; ready; ready = co) {
+            co = ready->next;
+            if(ready->deadline)
+                timer_remove(w, ready);
+            *w->ready_tail = ready;
+            w->ready_tail = &ready->next;
+        }
+    
+        /* a wake may have taken it off its bucket first, then it is already incoming */
+        now = clock_ns();
+        while(w->ntimers && w->timers[0]->deadline <= now) {
+            co = w->timers[0];
+            timer_remove(w, co);
+            if(co->word) {
+                b = co_bucket(co->word);
+                pthread_mutex_lock(&b->lock);
+                if(!co->queued) {
+                    pthread_mutex_unlock(&b->lock);
+                    continue;
+                }
+                co_unpark(co);
+                pthread_mutex_unlock(&b->lock);
+            }
+            *w->ready_tail = co;
+            w->ready_tail = &co->next;
+        }
+        *w->ready_tail = NULL;
+    
+        ready = w->ready;
+        w->ready = NULL;
+        w->ready_tail = &w->ready;
+        while((co = ready)) {
+            ready = co->next;
+            current = co;
+            co_ctx_swap(&w->sched, &co->ctx);
+            current = NULL;
+            w->switches++;
+    
+            if(co->done) {
+                munmap(co->stack, CO_STACK_SIZE);
+                free(co);
+                w->live--;
+            }
+        }
+    
+        if(__atomic_load_n(&w->incoming, __ATOMIC_ACQUIRE))
+            continue;
+        now = clock_ns();
+        if(!w->ntimers)
+            shm_wait(&w->kick, seen, &w->kick_waiters, 0, 0);
+        else if(w->timers[0]->deadline > now)
+            shm_wait(&w->kick, seen, &w->kick_waiters, 0, (w->timers[0]->deadline - now)*1e-9);
+    }
+    return NULL;
+}
@@ -0,0 +1,94 @@
+#ifndef CO_H_
+#define CO_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+#ifndef __x86_64__
+#include <ucontext.h>
+#endif
+
+#define CO_STACK_SIZE (128*1024)
+#define CO_MAX_WORKERS 256
+#define CO_WAIT_BUCKETS 256
+
+/*
+ Saved registers of a switched out coroutine. On x86-64 they are pushed
+ on its own stack and only the stack pointer is kept, so a switch costs
+ no system call; elsewhere ucontext is used.
+ */
+#ifdef __x86_64__
+typedef void *co_ctx_t;
+#else
+typedef ucontext_t co_ctx_t;
+#endif
+
+typedef struct co_s co_s;
+typedef struct co_bucket_s co_bucket_s;
+typedef struct co_worker_s co_worker_s;
+
+/*
+ A coroutine parks on a word the way a thread sleeps on a futex: it is
+ queued on the word's bucket until shm_wake is called on the word, and
+ on its worker's deadline heap if it has a timeout, and resumed by
+ whichever comes first. queued is guarded by the bucket's lock; slot
+ is its place in the heap and only touched by its worker.
+ */
+struct co_s
+{
+    co_ctx_t ctx;
+    void (*fn)(void *);
+    void *arg;
+    void *stack;
+    co_worker_s *worker;
+    uint32_t *word;
+    uint64_t deadline;
+    size_t slot;
+    bool queued;
+    bool done;
+    co_s *next;
+    co_s *wprev;
+    co_s *wnext;
+};
+
+/* Coroutines parked on any of the words that hash here */
+struct co_bucket_s
+{
+    pthread_mutex_t lock;
+    co_s *head;
+};
+
+/*
+ A thread multiplexing the coroutines pinned to it. Spawned and woken
+ coroutines arrive on incoming from any thread, which then bumps kick;
+ with nothing ready the worker sleeps on kick until the next deadline.
+ */
+struct co_worker_s
+{
+    pthread_t thread;
+    co_ctx_t sched;
+    pthread_mutex_t lock;
+    co_s *incoming;
+    co_s **incoming_tail;
+    co_s *ready;
+    co_s **ready_tail;
+    co_s **timers;
+    size_t ntimers;
+    size_t timers_size;
+    uint32_t kick;
+    uint32_t kick_waiters;
+    uint64_t switches;
+    size_t live;
+};
+
+extern void co_init(int nworkers);
+extern void co_spawn(void (*fn)(void *), void *arg, unsigned hint);
+extern co_s *co_self(void);
+extern void co_wait(uint32_t *word, uint32_t val, double timeout);
+extern void co_wake(uint32_t *word);
+extern void co_sleep(double secs);
+extern void co_report(void);
+
+#endif
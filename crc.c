@@ -0,0 +1,137 @@
+/* CRC32C with SSE4.2 when the CPU has it and a slicing-by-8 table otherwise */
+#include <string.h>
+
+#include <pthread.h>
+
+#include "crc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <nmmintrin.h>
+    #define CRC_HW
+#endif
+
+#define CRC_POLY 0x82F63B78u
+
+typedef uint32_t (*crc_fn)(uint32_t crc, void *dst, const void *src, size_t size);
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static uint32_t table[8][256];
+static crc_fn fold;
+static const char *impl;
+
+static void crc_init(void);
+static uint32_t sw_fold(uint32_t crc, void *dst, const void *src, size_t size);
+#ifdef CRC_HW
+static uint32_t hw_fold(uint32_t crc, void *dst, const void *src, size_t size);
+#endif
+
+void crc_init(void)
+{
+    uint32_t c;
+    int i, j;
+    
+    for(i = 0; i < 256; i++) {
+        c = i;
+        for(j = 0; j < 8; j++)
+            c = c & 1 ? (c >> 1) ^ CRC_POLY : c >> 1;
+        table[0][i] = c;
+    }
+    for(i = 0; i < 256; i++)
+        for(j = 1; j < 8; j++)
+            table[j][i] = (table[j-1][i] >> 8) ^ table[0][table[j-1][i] & 0xff];
+    
+    fold = sw_fold;
+    impl = "table";
+#ifdef CRC_HW
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) {
+        fold = hw_fold;
+        impl = "sse4.2";
+    }
+#endif
+}
+
+uint32_t crc_update(uint32_t crc, const void *buf, size_t size)
+{
+    pthread_once(&once, crc_init);
+    return fold(crc, NULL, buf, size);
+}
+
+/* Copy size bytes from src to dst, folding them into crc on the way */
+uint32_t crc_copy(uint32_t crc, void *dst, const void *src, size_t size)
+{
+    pthread_once(&once, crc_init);
+    return fold(crc, dst, src, size);
+}
+
+/* FCS of a whole buffer */
+uint32_t crc32c(const void *buf, size_t size)
+{
+    return crc_final(crc_update(CRC_INIT, buf, size));
+}
+
+const char *crc_impl(void)
+{
+    pthread_once(&once, crc_init);
+    return impl;
+}
+
+/* dst may be NULL to only checksum */
+uint32_t sw_fold(uint32_t crc, void *dst, const void *src, size_t size)
+{
+    const unsigned char *s = src;
+    unsigned char *d = dst;
+    uint32_t lo, hi;
+    
+    while(size >= 8) {
+        memcpy(&lo, s, 4);
+        memcpy(&hi, s + 4, 4);
+        if(d) {
+            memcpy(d, s, 8);
+            d += 8;
+        }
+        lo ^= crc;
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+        s += 8;
+        size -= 8;
+    }
+    while(size--) {
+        if(d)
+            *d++ = *s;
+        crc = (crc >> 8) ^ table[0][(crc ^ *s++) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef CRC_HW
+__attribute__((target("sse4.2")))
+uint32_t hw_fold(uint32_t crc, void *dst, const void *src, size_t size)
+{
+    const unsigned char *s = src;
+    unsigned char *d = dst;
+#ifdef __x86_64__
+    uint64_t w, c = crc;
+    
+    while(size >= 8) {
+        memcpy(&w, s, 8);
+        if(d) {
+            memcpy(d, &w, 8);
+            d += 8;
+        }
+        c = _mm_crc32_u64(c, w);
+        s += 8;
+        size -= 8;
+    }
+    crc = (uint32_t)c;
+#endif
+    while(size--) {
+        if(d)
+            *d++ = *s;
+        crc = _mm_crc32_u8(crc, *s++);
+    }
+    return crc;
+}
+#endif
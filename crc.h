@@ -0,0 +1,23 @@
+#ifndef CRC_H_
+#define CRC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ CRC32C (Castagnoli) frame check sequence. A running CRC starts at
+ CRC_INIT and is folded with crc_update or crc_copy; crc_final turns
+ it into the FCS sent little endian after the frame. Folding a whole
+ frame including its FCS leaves CRC_RESIDUE when the frame is intact.
+ */
+#define CRC_INIT 0xFFFFFFFFu
+#define CRC_RESIDUE 0xB798B438u
+
+#define crc_final(crc) (~(uint32_t)(crc))
+
+extern uint32_t crc_update(uint32_t crc, const void *buf, size_t size);
+extern uint32_t crc_copy(uint32_t crc, void *dst, const void *src, size_t size);
+extern uint32_t crc32c(const void *buf, size_t size);
+extern const char *crc_impl(void);
+
+#endif
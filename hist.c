@@ -0,0 +1,96 @@
+/* Log-linear latency histograms that can be merged across stations */
+#include <stdio.h>
+
+#include "hist.h"
+#include "stats.h"
+
+static int hist_index(uint64_t v);
+static uint64_t hist_highest(int i);
+
+void hist_record(hist_s *h, uint64_t ns)
+{
+    int i = hist_index(ns);
+    
+    if(!h->count || ns < h->min)
+        __atomic_store_n(&h->min, ns, __ATOMIC_RELAXED);
+    if(ns > h->max)
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    stat_inc(h->counts[i]);
+    stat_add(h->sum, ns);
+    stat_inc(h->count);
+}
+
+/* into must have no other writer meanwhile; h may still be live */
+void hist_merge(hist_s *into, const hist_s *h)
+{
+    int i;
+    uint64_t count = stat_get(h->count);
+    
+    if(!count)
+        return;
+    if(!into->count || stat_get(h->min) < into->min)
+        into->min = stat_get(h->min);
+    if(stat_get(h->max) > into->max)
+        into->max = stat_get(h->max);
+    for(i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += stat_get(h->counts[i]);
+    into->sum += stat_get(h->sum);
+    into->count += count;
+}
+
+/* The highest value in the bucket holding the p'th value, as HdrHistogram reports */
+uint64_t hist_percentile(const hist_s *h, double p)
+{
+    int i;
+    uint64_t seen = 0, count = stat_get(h->count), max = stat_get(h->max);
+    uint64_t rank = (uint64_t)(p*count + 0.999999);
+    
+    if(!count)
+        return 0;
+    if(!rank)
+        rank = 1;
+    for(i = 0; i < HIST_BUCKETS; i++) {
+        seen += stat_get(h->counts[i]);
+        if(seen >= rank)
+            break;
+    }
+    return i < HIST_BUCKETS && hist_highest(i) < max ? hist_highest(i) : max;
+}
+
+/* One line summary in microseconds, for the logs */
+int hist_format(const hist_s *h, char *buf, size_t size)
+{
+    uint64_t count = stat_get(h->count);
+    
+    if(!count)
+        return snprintf(buf, size, "no samples");
+    return snprintf(buf, size, "%llu samples, min %.1f us, mean %.1f us, p50 %.1f us, p90 %.1f us, "
+                    "p99 %.1f us, p99.9 %.1f us, max %.1f us",
+                    (unsigned long long)count, stat_get(h->min)*1e-3, (double)stat_get(h->sum)/count*1e-3,
+                    hist_percentile(h, 0.5)*1e-3, hist_percentile(h, 0.9)*1e-3,
+                    hist_percentile(h, 0.99)*1e-3, hist_percentile(h, 0.999)*1e-3,
+                    stat_get(h->max)*1e-3);
+}
+
+/* Below 2*HIST_SUB the value itself, above it HIST_SUB buckets per power of two */
+int hist_index(uint64_t v)
+{
+    int e;
+    
+    if(v < 2*HIST_SUB)
+        return (int)v;
+    e = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    if(e > HIST_MAX_BITS - 1 - HIST_SUB_BITS)
+        return HIST_BUCKETS - 1;
+    return e*HIST_SUB + (int)(v >> e);
+}
+
+uint64_t hist_highest(int i)
+{
+    int e;
+    
+    if(i < 2*HIST_SUB)
+        return i;
+    e = i/HIST_SUB - 1;
+    return (((uint64_t)(i%HIST_SUB + HIST_SUB) + 1) << e) - 1;
+}
@@ -0,0 +1,38 @@
+#ifndef HIST_H_
+#define HIST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 36
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1)*HIST_SUB)
+
+typedef struct hist_s hist_s;
+
+/*
+ Log-linear histogram of ns values in fixed memory, after HdrHistogram.
+ Values below 2*HIST_SUB get a bucket each; above that every power of
+ two is split into HIST_SUB linear buckets, so a bucket is never wider
+ than 1/HIST_SUB of its value. Values from 2^HIST_MAX_BITS ns (about
+ 69 s) up share the last bucket. Each histogram has a single writer;
+ hist_record uses relaxed atomics so another thread or process can read
+ it while it is live without torn values, though count, sum and the
+ buckets may then be a record apart.
+ */
+struct hist_s
+{
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint32_t counts[HIST_BUCKETS];
+};
+
+extern void hist_record(hist_s *h, uint64_t ns);
+extern void hist_merge(hist_s *into, const hist_s *h);
+extern uint64_t hist_percentile(const hist_s *h, double p);
+extern int hist_format(const hist_s *h, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,346 @@
+/* Event log: per-thread rings of formatted lines drained by one writer thread */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+#endif
+
+#include "log.h"
+#include "shared.h"
+
+int log_level = LOG_DEBUG;
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_t writer;
+static bool started;
+
+/*
+ Only the writer drains rings or takes them off the list, so it walks
+ the list without a lock. drain_lock orders new rings going on the
+ front against the writer unlinking orphans, and the writer only ever
+ tries it, so nothing waits on a thread holding it. The writer sleeps
+ on bell, which a thread rings when its ring goes from empty to not.
+ passes is bumped as each pass starts and ends, so it is odd during one.
+ */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_ring_s *rings;
+static uint32_t passes;
+static uint32_t bell;
+static uint32_t bell_waiters;
+
+static __thread log_ring_s *ring;
+static __thread bool appending;
+static __thread time_t stamp_sec = -1;
+static __thread char stamp[16];
+
+static void log_init(void);
+static log_ring_s *log_ring(void);
+static void log_orphan(void *arg);
+static void log_append(int fd, const char *line, size_t len);
+static bool drain(log_ring_s *r);
+static bool drain_all(void);
+static bool reap(void);
+static void ring_bell(void);
+static void write_iov(int fd, struct iovec *iov, int n);
+static void *log_writer(void *arg);
+
+void logevent(char *fs, ...)
+{
+    va_list args;
+    
+    va_start(args, fs);
+    vlogevent(logfile, name_stripped, fs, args);
+    va_end(args);
+}
+
+/*
+ logevent for a station other than this process's own. The wall clock
+ second is formatted once per thread and second; only the microseconds
+ are added per line.
+ */
+void vlogevent(FILE *f, const char *who, const char *fs, va_list args)
+{
+    char line[LOG_LINE_MAX];
+    struct timespec ts;
+    struct tm tm_time;
+    int n;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if(ts.tv_sec != stamp_sec) {
+        localtime_r(&ts.tv_sec, &tm_time);
+        strftime(stamp, sizeof(stamp), "%T", &tm_time);
+        stamp_sec = ts.tv_sec;
+    }
+    
+    n = snprintf(line, sizeof(line), "%.6s:\t%s.%06ld:\t", who, stamp, ts.tv_nsec/1000);
+    n += vsnprintf(line + n, sizeof(line) - n, fs, args);
+    if(n > (int)sizeof(line) - 1)
+        n = sizeof(line) - 1;
+    line[n++] = '\n';
+    log_append(fileno(f), line, n);
+}
+
+/*
+ Wait until everything logged so far is written out. A writer pass
+ running now may have missed it, so wait for the end of one that
+ starts after. No lock is taken, so this is safe from any thread or
+ from a signal handler.
+ */
+void log_flush(void)
+{
+    uint32_t done;
+    struct timespec nap = {0, LOG_WAIT_NS};
+    
+    if(!__atomic_load_n(&started, __ATOMIC_ACQUIRE) || pthread_equal(pthread_self(), writer))
+        return;
+    done = ((__atomic_load_n(&passes, __ATOMIC_SEQ_CST) + 1) & ~1u) + 2;
+    ring_bell();
+    while((int32_t)(__atomic_load_n(&passes, __ATOMIC_ACQUIRE) - done) < 0)
+        nanosleep(&nap, NULL);
+}
+
+/* Pending lines name the file by descriptor, so flush before it can be reused */
+void log_close(FILE *f)
+{
+    log_flush();
+    fclose(f);
+}
+
+void log_init(void)
+{
+    int status;
+    sigset_t mask, old;
+    
+    pthread_key_create(&ring_key, log_orphan);
+    
+    /* signals are for the threads doing the work */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, &old);
+    status = pthread_create(&writer, NULL, log_writer, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(status) {
+        perror("Failed to create log writer");
+        exit(EXIT_FAILURE);
+    }
+    __atomic_store_n(&started, true, __ATOMIC_RELEASE);
+    atexit(log_flush);
+}
+
+log_ring_s *log_ring(void)
+{
+    log_ring_s *r;
+    
+    if(ring)
+        return ring;
+    pthread_once(&once, log_init);
+    
+    r = aligned_alloc(LOG_CACHE_LINE, sizeof(*r));
+    if(!r) {
+        perror("Failed to allocate memory");
+        exit(EXIT_FAILURE);
+    }
+    memset(r, 0, sizeof(*r));
+    r->buf = alloc(LOG_RING_SIZE);
+    pthread_mutex_lock(&drain_lock);
+    r->next = rings;
+    __atomic_store_n(&rings, r, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&drain_lock);
+    pthread_setspecific(ring_key, r);
+    return ring = r;
+}
+
+/* The writer frees a ring once its thread has exited and it is empty */
+void log_orphan(void *arg)
+{
+    log_ring_s *r = arg;
+    
+    __atomic_store_n(&r->orphaned, true, __ATOMIC_RELEASE);
+    ring_bell();
+}
+
+/*
+ Copy a line onto this thread's ring, waiting for the writer if it is
+ full. Only a line landing on an empty ring rings the bell, as the
+ writer keeps draining until it finds every ring empty. A line logged
+ from a signal handler that interrupted an append is written straight
+ out instead.
+ */
+void log_append(int fd, const char *line, size_t len)
+{
+    log_ring_s *r = log_ring();
+    log_rec_s *rec;
+    size_t size = (sizeof(*rec) + len + 7) & ~(size_t)7;
+    size_t off, room;
+    uint64_t start = r->head, head = start;
+    struct timespec nap = {0, LOG_WAIT_NS};
+    struct iovec direct = {(void *)line, len};
+    
+    if(appending) {
+        write_iov(fd, &direct, 1);
+        return;
+    }
+    appending = true;
+    
+    off = head % LOG_RING_SIZE;
+    room = LOG_RING_SIZE - off;
+    if(room < size) {
+        while(head + room - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE - size)
+            nanosleep(&nap, NULL);
+        rec = (log_rec_s *)(r->buf + off);
+        rec->fd = -1;
+        rec->len = room - sizeof(*rec);
+        head += room;
+        off = 0;
+    }
+    while(head + size - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE)
+        nanosleep(&nap, NULL);
+    
+    rec = (log_rec_s *)(r->buf + off);
+    rec->fd = fd;
+    rec->len = len;
+    memcpy(rec + 1, line, len);
+    __atomic_store_n(&r->head, head + size, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == start)
+        ring_bell();
+    appending = false;
+}
+
+/* Write a ring's lines, one writev per run of lines for the same file */
+bool drain(log_ring_s *r)
+{
+    struct iovec iov[LOG_IOV_MAX];
+    log_rec_s *rec;
+    uint64_t tail = r->tail, done = tail;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+    int n = 0, fd = -1;
+    
+    if(tail == head)
+        return false;
+    while(tail != head) {
+        rec = (log_rec_s *)(r->buf + tail % LOG_RING_SIZE);
+        if(n && (rec->fd != fd || n == LOG_IOV_MAX)) {
+            write_iov(fd, iov, n);
+            __atomic_store_n(&r->tail, done = tail, __ATOMIC_SEQ_CST);
+            n = 0;
+        }
+        if(rec->fd >= 0) {
+            fd = rec->fd;
+            iov[n].iov_base = rec + 1;
+            iov[n].iov_len = rec->len;
+            n++;
+        }
+        tail += (sizeof(*rec) + rec->len + 7) & ~(size_t)7;
+    }
+    if(n)
+        write_iov(fd, iov, n);
+    if(done != tail)
+        __atomic_store_n(&r->tail, tail, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+/* One pass over every ring; true if anything was written. Writer only */
+bool drain_all(void)
+{
+    log_ring_s *r;
+    bool busy = false;
+    
+    for(r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+        if(drain(r))
+            busy = true;
+    return busy;
+}
+
+/*
+ Free the rings of exited threads once they are empty, if no thread is
+ adding one; true if any are left for a later try.
+ */
+bool reap(void)
+{
+    log_ring_s *r, **p;
+    bool left = false;
+    
+    if(pthread_mutex_trylock(&drain_lock))
+        return true;
+    for(p = &rings; (r = *p); ) {
+        if(!__atomic_load_n(&r->orphaned, __ATOMIC_ACQUIRE)) {
+            p = &r->next;
+            continue;
+        }
+        if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail) {
+            left = true;
+            p = &r->next;
+            continue;
+        }
+        *p = r->next;
+        free(r->buf);
+        free(r);
+    }
+    pthread_mutex_unlock(&drain_lock);
+    return left;
+}
+
+/* Wake the writer; only atomics and a system call, so fine from a signal handler */
+void ring_bell(void)
+{
+    __atomic_add_fetch(&bell, 1, __ATOMIC_SEQ_CST);
+    if(!__atomic_load_n(&bell_waiters, __ATOMIC_SEQ_CST))
+        return;
+#ifdef __linux__
+    syscall(SYS_futex, &bell, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
+
+void write_iov(int fd, struct iovec *iov, int n)
+{
+    ssize_t status;
+    
+    while(n) {
+        status = writev(fd, iov, n);
+        if(status < 0) {
+            if(errno == EINTR)
+                continue;
+            return;
+        }
+        while(n && (size_t)status >= iov->iov_len) {
+            status -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if(n) {
+            iov->iov_base = (char *)iov->iov_base + status;
+            iov->iov_len -= status;
+        }
+    }
+}
+
+/*
+ The only thread that writes lines out, so no lock is held across I/O.
+ Once a pass finds every ring empty it sleeps until the bell rings,
+ with a timeout only while exited threads' rings are waiting to go.
+ */
+void *log_writer(void *arg)
+{
+    uint32_t seen;
+    bool busy;
+    
+    while(true) {
+        seen = __atomic_load_n(&bell, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&passes, 1, __ATOMIC_SEQ_CST);
+        busy = drain_all();
+        __atomic_add_fetch(&passes, 1, __ATOMIC_RELEASE);
+        if(!busy)
+            shm_wait(&bell, seen, &bell_waiters, 0, reap() ? LOG_REAP_SECS : 0);
+    }
+    return NULL;
+}
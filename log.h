@@ -0,0 +1,63 @@
+#ifndef LOG_H_
+#define LOG_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+
+/*
+ Levels for logat. Unconditional logevent calls are errors and reports.
+ Events above log_level are skipped before their arguments are
+ evaluated, and those above LOG_MAX_LEVEL are compiled out.
+ */
+#define LOG_ERROR 0
+#define LOG_INFO 1
+#define LOG_DEBUG 2
+#ifndef LOG_MAX_LEVEL
+#define LOG_MAX_LEVEL LOG_DEBUG
+#endif
+
+#define LOG_RING_SIZE (64*1024)
+#define LOG_LINE_MAX 1024
+#define LOG_IOV_MAX 64
+#define LOG_WAIT_NS 100000
+#define LOG_REAP_SECS 0.1
+#define LOG_CACHE_LINE 64
+
+#define log_enabled(level) ((level) <= LOG_MAX_LEVEL && (level) <= log_level)
+#define logat(level, ...) do { if(log_enabled(level)) logevent(__VA_ARGS__); } while(0)
+
+typedef struct log_ring_s log_ring_s;
+typedef struct log_rec_s log_rec_s;
+
+/*
+ A thread's formatted lines waiting for the writer. The owner only
+ advances head and the writer only advances tail, so appending takes
+ no lock; rings are allocated cache line aligned with tail on a line
+ of its own. Records are 8 byte aligned, and one with fd -1 pads out
+ the end of the buffer when the next line doesn't fit before it wraps.
+ */
+struct log_ring_s
+{
+    char *buf;
+    uint64_t head;
+    uint64_t tail __attribute__((aligned(LOG_CACHE_LINE)));
+    bool orphaned;
+    log_ring_s *next;
+} __attribute__((aligned(LOG_CACHE_LINE)));
+
+struct log_rec_s
+{
+    int fd;
+    uint32_t len;
+};
+
+extern int log_level;
+
+extern void logevent(char *fs, ...);
+extern void vlogevent(FILE *f, const char *who, const char *fs, va_list args);
+extern void log_flush(void);
+extern void log_close(FILE *f);
+
+#endif
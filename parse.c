@@ -17,6 +17,7 @@
 
 
 #include "parse.h"
+#include "traffic.h"
 
 #define INIT_BUF_SIZE 256
 #define N_FUNCS 6
@@ -75,6 +76,8 @@ struct check_s
     scope_s *scope;
 };
 
+tqueue_s tqueue;
+
 static token_s *head;
 static token_s *tokcurr;
 static token_s *tail;
@@ -1051,8 +1054,9 @@ void tostring(buf_s **buf, object_s *obj)
 /*
   -node src,
   -node dst,
-  -int period,
-  -int repeat
+  -int period, or a string naming its arrival process (see traffic.h)
+  -int repeat,
+  -int saturate, keep a frame queued at all times instead of using period
  
  no pretty way to do this :(
  */
@@ -1063,6 +1067,8 @@ object_s net_send(void *arg)
     object_s *args = arg;
     object_s ret;
     static token_s *dummy;
+    traffic_s traffic;
+    bool saturate;
     send_s *send;
     buf_s *payload;
     objlist_s   src, *src_ = &src,
@@ -1078,6 +1084,7 @@ object_s net_send(void *arg)
         FTABLE_MSG,
         FTABLE_PERIOD,
         FTABLE_REPEAT,
+        FTABLE_SATURATE,
         FTABLE_SIZE
     };
     
@@ -1090,8 +1097,9 @@ object_s net_send(void *arg)
         {false, "src", {0}, TYPE_NODE | TYPE_AGGREGATE | TYPE_STRING},
         {false, "dst", {0}, TYPE_NODE | TYPE_AGGREGATE | TYPE_STRING},
         {false, "msg", {0}, TYPE_AGGREGATE | TYPE_STRING | TYPE_REAL | TYPE_INT},
-        {false, "period", {0}, TYPE_INT | TYPE_INF | TYPE_REAL},
-        {false, "repeat", {0}, TYPE_INT}
+        {false, "period", {0}, TYPE_INT | TYPE_INF | TYPE_REAL | TYPE_STRING},
+        {false, "repeat", {0}, TYPE_INT},
+        {false, "saturate", {0}, TYPE_INT}
     };
 
     assert(args->type == TYPE_ARGLIST);
@@ -1334,6 +1342,35 @@ object_s net_send(void *arg)
         table[FTABLE_REPEAT].obj.tok = dummy;
     }
     
+    if(table[FTABLE_SATURATE].filled)
+        table[FTABLE_SATURATE].filled = false;
+    else {
+        if(!dummy) {
+            dummy = alloc(sizeof(*dummy));
+            dummy->lexeme = strdup("0");
+            dummy->type = TOK_TYPE_NUM;
+            dummy->att = TOK_ATT_INT;
+            dummy->next = NULL;
+            dummy->prev = NULL;
+            dummy->lineno = 0;
+            dummy->marked = true;
+        }
+        table[FTABLE_SATURATE].obj.child = NULL;
+        table[FTABLE_SATURATE].obj.islazy = false;
+        table[FTABLE_SATURATE].obj.type = TYPE_INT;
+        table[FTABLE_SATURATE].obj.arglist = NULL;
+        table[FTABLE_SATURATE].obj.tok = dummy;
+    }
+    saturate = !!atoi(table[FTABLE_SATURATE].obj.tok->lexeme);
+    
+    if(!table[FTABLE_PERIOD].obj.islazy) {
+        if(!traffic_parse(&traffic, table[FTABLE_PERIOD].obj.tok->lexeme)) {
+            error("Error at line %d: Invalid period %s passed to function \"send\"",
+                  table[FTABLE_PERIOD].obj.tok->lineno, table[FTABLE_PERIOD].obj.tok->lexeme);
+        }
+        traffic_free(&traffic);
+    }
+    
     flatten(&src_, &table[FTABLE_SRC].obj);
     flatten(&dst_, &table[FTABLE_DST].obj);
     
@@ -1351,11 +1388,13 @@ object_s net_send(void *arg)
                     send->dst = dst_->obj->tok->lexeme;
                     send->size = payload->size;
                     send->payload = payload->buf;
-                    if(table[FTABLE_PERIOD].obj.islazy)
+                    if(saturate)
+                        send->period = "saturate";
+                    else if(table[FTABLE_PERIOD].obj.islazy)
                         send->period = "-1";
                     else
                         send->period = table[FTABLE_PERIOD].obj.tok->lexeme;
-                    send->repeat = !!atoi(table[FTABLE_REPEAT].obj.tok->lexeme);
+                    send->repeat = saturate || !!atoi(table[FTABLE_REPEAT].obj.tok->lexeme);
                     task_enqueue((task_s *)send);
                 }
             }
@@ -1389,10 +1428,11 @@ object_s net_node(void *arg)
     object_s objr;
     arg_s *a;
     const char *default_ifs = "0.02";
-    bool gotname = false, gotifs = false;
+    const char *default_channel = "0";
+    bool gotname = false, gotifs = false, gotchannel = false, gotseed = false;
     enum {
         MIN_NODE_ARGS = 1,
-        MAX_NODE_ARGS = 2,
+        MAX_NODE_ARGS = 4,
         MAX_NAME_SIZE = 6
     };
     
@@ -1404,7 +1444,7 @@ object_s net_node(void *arg)
     if(obj->arglist->size > MAX_NODE_ARGS || obj->arglist->size < MIN_NODE_ARGS) {
         error(
               "Error: Invalid number of arguments passed to function node at line %u. \
-              Expected node(string) with optional int or real.",
+              Expected node(string) with optional int or real, channel and seed.",
               obj->tok->lineno
              );
         objr.type = TYPE_ERROR;
@@ -1412,7 +1452,8 @@ object_s net_node(void *arg)
         return objr;
     }
     else {
-        t = allocz(sizeof(*t) + 2*sizeof(char *));
+        /* name, ifs, channel, and seed or NULL to derive it from the run seed */
+        t = allocz(sizeof(*t) + 4*sizeof(char *));
         t->func = FNET_NODE;
         t->next = NULL;
         for(a = obj->arglist->head; a; a = a->next) {
@@ -1478,6 +1519,58 @@ object_s net_node(void *arg)
                         return objr;
                     }
                 }
+                else if(!strcmp("channel", a->name)) {
+                    if(a->obj.type == TYPE_INT) {
+                        if(!gotchannel) {
+                            *((char **)(t + 1) + 2) = a->obj.tok->lexeme;
+                            gotchannel = true;
+                        }
+                        else {
+                            error(
+                                  "Error at line %u: Duplicate channels specified.",
+                                  obj->tok->lineno
+                                  );
+                            free(t);
+                            objr.type = TYPE_ERROR;
+                            return objr;
+                        }
+                    }
+                    else {
+                        error(
+                              "Error at line %u: Invalid type for node channel. Expected int.",
+                              obj->tok->lineno
+                              );
+                        free(t);
+                        objr.type = TYPE_ERROR;
+                        return objr;
+                    }
+                }
+                else if(!strcmp("seed", a->name)) {
+                    if(a->obj.type == TYPE_INT) {
+                        if(!gotseed) {
+                            *((char **)(t + 1) + 3) = a->obj.tok->lexeme;
+                            gotseed = true;
+                        }
+                        else {
+                            error(
+                                  "Error at line %u: Duplicate seeds specified.",
+                                  obj->tok->lineno
+                                  );
+                            free(t);
+                            objr.type = TYPE_ERROR;
+                            return objr;
+                        }
+                    }
+                    else {
+                        error(
+                              "Error at line %u: Invalid type for node seed. Expected int.",
+                              obj->tok->lineno
+                              );
+                        free(t);
+                        objr.type = TYPE_ERROR;
+                        return objr;
+                    }
+                }
             }
             else {
                 switch(a->obj.type) {
@@ -1537,6 +1630,8 @@ object_s net_node(void *arg)
         if(gotname) {
             if(!gotifs)
                 *((char **)(t + 1) + 1) = strdup(default_ifs);
+            if(!gotchannel)
+                *((char **)(t + 1) + 2) = strdup(default_channel);
             task_enqueue(t);
         }
         else {
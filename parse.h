@@ -25,6 +25,7 @@ typedef struct objlist_s objlist_s;
 
 typedef struct task_s task_s;
 typedef struct send_s send_s;
+typedef struct tqueue_s tqueue_s;
 
 enum tok_types_e {
     TOK_TYPE_ID = 0,
@@ -157,11 +158,13 @@ struct objlist_s
     objlist_s *next;
 };
 
-struct {
+struct tqueue_s
+{
     task_s *head;
     task_s *tail;
-}
-tqueue;
+};
+
+extern tqueue_s tqueue;
 
 extern bool parse(char *src);
 
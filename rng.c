@@ -0,0 +1,76 @@
+/* Per-station xoshiro256** generators with seeds derived from the run seed */
+#include <stdint.h>
+
+#include "rng.h"
+
+static uint64_t splitmix(uint64_t *x);
+
+#define rotl(x, k) (((x) << (k)) | ((x) >> (64 - (k))))
+
+/* Fold a name into a seed with FNV-1a, then scramble the result */
+uint64_t rng_mix(uint64_t seed, const char *name)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    
+    while(*name) {
+        h ^= (unsigned char)*name++;
+        h *= 0x100000001b3ull;
+    }
+    h ^= seed;
+    return splitmix(&h);
+}
+
+/* The state is filled from splitmix64 so that no seed gives all zeros */
+void rng_seed(rng_s *r, uint64_t seed)
+{
+    int i;
+    
+    for(i = 0; i < 4; i++)
+        r->s[i] = splitmix(&seed);
+}
+
+uint64_t rng_next(rng_s *r)
+{
+    uint64_t *s = r->s;
+    uint64_t result = rotl(s[1]*5, 7)*9;
+    uint64_t t = s[1] << 17;
+    
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+/* Uniform in [0, 1) from the top 53 bits */
+double rng_unit(rng_s *r)
+{
+    return (rng_next(r) >> 11)*0x1.0p-53;
+}
+
+/* Uniform in [0, n) without modulo bias, by Lemire's multiply-shift */
+uint32_t rng_below(rng_s *r, uint32_t n)
+{
+    uint64_t m = (rng_next(r) >> 32)*n;
+    uint32_t low = (uint32_t)m, threshold;
+    
+    if(low < n) {
+        threshold = -n % n;
+        while(low < threshold) {
+            m = (rng_next(r) >> 32)*n;
+            low = (uint32_t)m;
+        }
+    }
+    return (uint32_t)(m >> 32);
+}
+
+uint64_t splitmix(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+    
+    z = (z ^ (z >> 30))*0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27))*0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
@@ -0,0 +1,24 @@
+#ifndef RNG_H_
+#define RNG_H_
+
+#include <stdint.h>
+
+typedef struct rng_s rng_s;
+
+/*
+ xoshiro256** state, one per station so backoff draws take no lock and
+ a run can be replayed. A station's stream is seeded from the run seed
+ and its name through rng_mix, so stations never share a sequence.
+ */
+struct rng_s
+{
+    uint64_t s[4];
+};
+
+extern uint64_t rng_mix(uint64_t seed, const char *name);
+extern void rng_seed(rng_s *r, uint64_t seed);
+extern uint64_t rng_next(rng_s *r);
+extern double rng_unit(rng_s *r);
+extern uint32_t rng_below(rng_s *r, uint32_t n);
+
+#endif
@@ -1,12 +1,23 @@
 #include "shared.h"
+#include "co.h"
 #include <stdarg.h>
 #include <errno.h>
 #include <assert.h>
 #include <time.h>
+#include <string.h>
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef __linux__
+    #include <linux/futex.h>
+    #include <sys/syscall.h>
+#endif
 
 FILE *logfile;
 char *name;
@@ -14,10 +25,13 @@ char *name_stripped;
 size_t name_len;
 medium_s *mediums;
 medium_s *mediumc;
-pthread_t timer_thread;
 
-static volatile sig_atomic_t timed_out;
-static void *timer_threadf(void *arg);
+static void *shm_map(int fd, size_t size);
+static slot_s *medium_slot(medium_s *medium, uint64_t pos);
+static ssize_t bulkread(medium_s *medium, void *buf, size_t size, uint32_t *crc);
+static int bulkwrite(medium_s *medium, void *buf, size_t size);
+static ssize_t ring_read(medium_s *medium, uint64_t *cursor, void *buf, size_t size, size_t *len, uint32_t *crc);
+static int ring_write(medium_s *medium, void *buf, size_t size);
 
 
 bool addr_cmp(char *addr1, char *addr2)
@@ -30,178 +44,522 @@ bool addr_cmp(char *addr1, char *addr2)
     return (*a32 == *b32) && (*a16 == *b16);
 }
 
-void *timer_threadf(void *arg)
+/*
+ Copy into the stream at its current size in at most two segments.
+ Returns EMSGSIZE for a frame longer than the stream.
+ */
+size_t write_shm(medium_s *medium, char *data, size_t size)
 {
-    struct timespec ts;
-    struct timeval tp;
-    pthread_mutex_t lock;
-    pthread_cond_t cond;
-    double tmp;
-    timerarg_s *targ = arg;
-    
-    pthread_mutex_init(&lock, NULL);
-    pthread_cond_init(&cond, NULL);
+    size_t start, n;
     
-    gettimeofday(&tp, NULL);
+    if(size > medium->capacity)
+        return EMSGSIZE;
+    start = medium->size % medium->capacity;
     
-    tmp = targ->time + tp.tv_sec + tp.tv_usec/1e6;
-    ts.tv_sec = (long)tmp;
-    ts.tv_nsec = (long)((tmp - ts.tv_sec)*1e9);
+    n = medium->capacity - start;
+    if(n > size)
+        n = size;
+    memcpy(&medium->buf[start], data, n);
+    memcpy(medium->buf, data + n, size - n);
     
-    pthread_mutex_lock(&lock);
-    pthread_cond_timedwait(&cond, &lock, &ts);
-    pthread_mutex_unlock(&lock);
-    
-    pthread_mutex_destroy(&lock);
-    pthread_cond_destroy(&cond);
+    return 0;
+}
+
+/*
+ Wait until [start, start+size) has been published, then copy it out,
+ folding the bytes into *crc on the way if crc is not NULL. Returns
+ EMSGSIZE for a frame longer than the stream.
+ */
+size_t read_shm(medium_s *medium, char *data, size_t start, size_t size, timer_s *timer, uint32_t *crc)
+{
+    size_t n, end = start + size;
+    uint32_t seen;
     
-    pthread_kill(targ->sender, SIGALRM);
+    if(size > medium->capacity)
+        return EMSGSIZE;
+    while(end > (seen = __atomic_load_n(&medium->size, __ATOMIC_ACQUIRE))) {
+        if(timer_expired(timer))
+            return EINTR;
+        shm_wait(&medium->size, seen, &medium->size_waiters, medium->spin, WAIT_SLICE);
+    }
     
-    free(arg);
+    start %= medium->capacity;
+    n = medium->capacity - start;
+    if(n > size)
+        n = size;
+    if(crc) {
+        *crc = crc_copy(*crc, data, &medium->buf[start], n);
+        *crc = crc_copy(*crc, data + n, medium->buf, size - n);
+    }
+    else {
+        memcpy(data, &medium->buf[start], n);
+        memcpy(data + n, medium->buf, size - n);
+    }
     
-    pthread_exit(NULL);
+    return 0;
 }
 
-void start_timer(double time)
+void set_busy(medium_s *medium, bool isbusy)
 {
-    int status;
-    timerarg_s *t = alloc(sizeof(t));
-    
-    timed_out = 0;
-    t->time = time;
-    t->sender = pthread_self();
-    status = pthread_create(&timer_thread, NULL, timer_threadf, t);
-    if(status) {
-        perror("Failed to create timer thread");
-        exit(EXIT_FAILURE);
-    }
+    __atomic_store_n(&medium->isbusy, isbusy, __ATOMIC_SEQ_CST);
+    if(!isbusy)
+        shm_wake(&medium->isbusy, &medium->busy_waiters);
 }
 
-size_t write_shm(medium_s *medium, char *data, size_t size)
+/*
+ Carrier sense: block until nobody holds the medium or *stop is set.
+ An AP that exits mid exchange never frees the medium, so the wait is
+ sliced and stop checked in between.
+ */
+void wait_idle(medium_s *medium, volatile bool *stop)
 {
-    long i;
+    while(__atomic_load_n(&medium->isbusy, __ATOMIC_ACQUIRE) && !*stop)
+        shm_wait(&medium->isbusy, true, &medium->busy_waiters, medium->spin, WAIT_SLICE);
+}
 
-    for(i = medium->size; i < size+medium->size; i++)
-        medium->buf[i % MEDIUM_SIZE] = *data++;
-    
-    return 0;
+/* Segment names are /<run>.<kind><channel>, e.g. /csma-1234.s0 */
+void shm_name(char *buf, const char *run, char kind, int channel)
+{
+    snprintf(buf, SHM_NAME_SIZE, "/%s.%c%d", run, kind, channel);
 }
 
-size_t read_shm(medium_s *medium, char *data, size_t start, size_t size)
+/*
+ Create and map a named segment. With huge set the segment is put on
+ hugetlbfs when it is mounted and has pages to spare, otherwise it is
+ a regular POSIX segment advised to use transparent huge pages.
+ */
+void *shm_create(const char *name, size_t size, bool huge)
 {
-    long i;
+    int fd;
+    void *ptr = MAP_FAILED;
+    char path[sizeof(HUGE_DIR) + SHM_NAME_SIZE];
     
-    for(i = start; i < start + size; i++) {
-        if(timed_out)
-            return EINTR;
-        if(i >= medium->size) {
-            while(i >= medium->size) {
-                if(timed_out)
-                    return EINTR;
-            }
+    if(huge) {
+        size = (size + HUGE_PAGE_SIZE-1) & ~(size_t)(HUGE_PAGE_SIZE-1);
+        snprintf(path, sizeof(path), "%s%s", HUGE_DIR, name);
+        fd = open(path, O_CREAT|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR);
+        if(fd >= 0) {
+            if(!ftruncate(fd, size))
+                ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, 0);
+            close(fd);
+            if(ptr != MAP_FAILED)
+                return ptr;
+            unlink(path);
         }
-        *data++ = medium->buf[i % MEDIUM_SIZE];
     }
-    return 0;
+    
+    fd = shm_open(name, O_CREAT|O_RDWR|O_TRUNC, S_IRUSR|S_IWUSR);
+    if(fd < 0) {
+        perror("Failed to set up shared memory segment");
+        exit(EXIT_FAILURE);
+    }
+    if(ftruncate(fd, size) < 0) {
+        perror("Failed to size shared memory segment");
+        exit(EXIT_FAILURE);
+    }
+    ptr = shm_map(fd, size);
+#ifdef MADV_HUGEPAGE
+    if(huge)
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    return ptr;
 }
 
-void set_busy(medium_s *medium, bool isbusy)
+/* Map a segment created by shm_create, wherever it ended up */
+void *shm_attach(const char *name)
 {
-    medium->isbusy = isbusy;
+    int fd;
+    struct stat st;
+    char path[sizeof(HUGE_DIR) + SHM_NAME_SIZE];
+    
+    fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0) {
+        snprintf(path, sizeof(path), "%s%s", HUGE_DIR, name);
+        fd = open(path, O_RDWR);
+    }
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        perror("Failed to locate shared memory segment.");
+        exit(EXIT_FAILURE);
+    }
+    return shm_map(fd, st.st_size);
 }
 
-void sigALARM(int sig)
+void shm_remove(const char *name)
 {
-    timed_out = 1;
+    char path[sizeof(HUGE_DIR) + SHM_NAME_SIZE];
+    
+    snprintf(path, sizeof(path), "%s%s", HUGE_DIR, name);
+    shm_unlink(name);
+    unlink(path);
 }
 
-void logevent(char *fs, ...)
+void *shm_map(int fd, size_t size)
 {
-    va_list args;
-    time_t t;
-    struct tm tm_time;
-    char timestamp[16];
-    
-    static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-    
-    pthread_mutex_lock(&lock);
+    void *ptr;
     
-    fprintf(logfile, "%.6s:", name_stripped);
-    fputc('\t', logfile);
-    
-    time(&t);
-    localtime_r(&t, &tm_time);
-    strftime(timestamp, 16, "%T:\t", &tm_time);
-    
-    fprintf(logfile, "%s", timestamp);
+    ptr = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(ptr == MAP_FAILED) {
+        perror("Failed to map shared memory segment.");
+        exit(EXIT_FAILURE);
+    }
+    return ptr;
+}
+
+/*
+ Wait while *word == val. Spins for spin iterations, then sleeps on
+ the word for at most timeout seconds (forever if 0). Returns early
+ on a wake, a change of value or a signal, so callers must recheck.
+ */
+void shm_wait(uint32_t *word, uint32_t val, uint32_t *waiters, uint32_t spin, double timeout)
+{
+    uint32_t i;
+    struct timespec ts, *tsp = NULL;
     
-    va_start(args, fs);
-    vfprintf(logfile, fs, args);
-    va_end(args);
+    /* a coroutine parks instead of blocking its worker */
+    if(co_self()) {
+        co_wait(word, val, timeout);
+        return;
+    }
     
-    fputc('\n', logfile);
+    for(i = 0; i < spin; i++) {
+        if(__atomic_load_n(word, __ATOMIC_ACQUIRE) != val)
+            return;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
     
-    fflush(logfile);
+    if(timeout > 0) {
+        ts.tv_sec = (long)timeout;
+        ts.tv_nsec = (long)((timeout - ts.tv_sec)*1e9);
+        tsp = &ts;
+    }
     
-    pthread_mutex_unlock(&lock);
+    __atomic_fetch_add(waiters, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(word, __ATOMIC_SEQ_CST) == val) {
+#ifdef __linux__
+        syscall(SYS_futex, word, FUTEX_WAIT, val, tsp, NULL, 0);
+#else
+        if(tsp)
+            nanosleep(tsp, NULL);
+        else
+            sched_yield();
+#endif
+    }
+    __atomic_fetch_sub(waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Wake sleepers on word, skipping the syscall if there are none */
+void shm_wake(uint32_t *word, uint32_t *waiters)
+{
+    /* coroutines park on the word in this process, not in the kernel */
+    co_wake(word);
+    if(!__atomic_load_n(waiters, __ATOMIC_SEQ_CST))
+        return;
+#ifdef __linux__
+    syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+/* nanosleep that only suspends the caller when it is a coroutine */
+void snooze(const struct timespec *ts)
+{
+    if(co_self())
+        co_sleep(ts->tv_sec + ts->tv_nsec*1e-9);
+    else
+        nanosleep(ts, NULL);
+}
+
+/* Only here so SIGALRM from the timer service interrupts blocking waits */
+void sigALARM(int sig)
+{
 }
 
 /* Make reads even "more" of a race condition */
-ssize_t slowread(medium_s *medium, void *buf, size_t size)
+ssize_t slowread(medium_s *medium, void *buf, size_t size, uint32_t *crc)
 {
     size_t i;
     ssize_t status;
+    timer_s timer;
     
-    start_timer(WAIT_TIME);
+    if(size > medium->capacity)
+        return EMSGSIZE;
+    timer_start(&timer, WAIT_TIME);
     for(i = 0; i < size; i++) {
-        status = read_shm(medium, buf+i, i, sizeof(char));
+        status = read_shm(medium, buf+i, i, sizeof(char), &timer, crc);
         if(status == EINTR) {
-            pthread_cancel(timer_thread);
+            timer_cancel(&timer);
             return EINTR;
         }
     }
-    pthread_cancel(timer_thread);
+    timer_cancel(&timer);
     return 0;
 }
 
 /* Make writes even "more" of a race condition */
-void slowwrite(medium_s *medium, void *buf, size_t size)
+int slowwrite(medium_s *medium, void *buf, size_t size)
 {
     size_t i;
     
+    if(size > medium->capacity)
+        return EMSGSIZE;
     medium->size = 0;
     for(i = 0; i < size; i++) {
         write_shm(medium, buf+i, sizeof(char));
-        medium->size++;
+        __atomic_fetch_add(&medium->size, 1, __ATOMIC_SEQ_CST);
+        shm_wake(&medium->size, &medium->size_waiters);
     }
+    return 0;
 }
 
-void *alloc(size_t size)
+/* Size of a shared segment holding a medium of the given capacity */
+size_t medium_bytes(size_t capacity)
 {
-    void *ptr = malloc(size);
-    if(!ptr){
-        perror("Memory Allocation Error");
-        exit(EXIT_FAILURE);
+    size_t stride = (sizeof(slot_s) + capacity + CACHE_LINE-1) & ~(size_t)(CACHE_LINE-1);
+    size_t slots = (capacity + CACHE_LINE-1) & ~(size_t)(CACHE_LINE-1);
+    
+    return sizeof(medium_s) + slots + MEDIUM_SLOTS*stride;
+}
+
+void medium_init(medium_s *medium, medium_mode_e mode, bool broadcast, uint32_t spin, size_t capacity)
+{
+    int i;
+    
+    medium->isbusy = false;
+    medium->size = 0;
+    medium->busy_waiters = 0;
+    medium->size_waiters = 0;
+    medium->spin = spin;
+    medium->agg_count = 1;
+    medium->agg_bytes = capacity - sizeof(uint32_t);
+    medium->mode = mode;
+    medium->broadcast = broadcast;
+    medium->head = 0;
+    medium->tail = 0;
+    medium->capacity = capacity;
+    medium->nslots = MEDIUM_SLOTS;
+    medium->slot_stride = (sizeof(slot_s) + capacity + CACHE_LINE-1) & ~(size_t)(CACHE_LINE-1);
+    medium->slots = (capacity + CACHE_LINE-1) & ~(size_t)(CACHE_LINE-1);
+    for(i = 0; i < medium->nslots; i++)
+        medium_slot(medium, i)->seq = 0;
+}
+
+slot_s *medium_slot(medium_s *medium, uint64_t pos)
+{
+    return (slot_s *)&medium->buf[medium->slots + (pos % medium->nslots)*medium->slot_stride];
+}
+
+/* Position a new reader should start from */
+uint64_t medium_mark(medium_s *medium)
+{
+    if(medium->mode == MEDIUM_RING)
+        return __atomic_load_n(&medium->head, __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+ssize_t medium_read(medium_s *medium, uint64_t *cursor, void *buf, size_t size)
+{
+    size_t len;
+    
+    switch(medium->mode) {
+        case MEDIUM_RING:
+            return ring_read(medium, cursor, buf, size, &len, NULL);
+        case MEDIUM_BULK:
+            return bulkread(medium, buf, size, NULL);
+        default:
+            return slowread(medium, buf, size, NULL);
     }
-    return ptr;
 }
 
-void *allocz(size_t size)
+/*
+ Read a frame of size bytes ending in its FCS, checking it in the same
+ pass as the copy. Returns EBADMSG if the check fails or, on a ring,
+ if the frame found is not size bytes long, and EMSGSIZE if size is
+ more than the medium holds.
+ */
+ssize_t medium_read_fcs(medium_s *medium, uint64_t *cursor, void *buf, size_t size)
 {
-    void *ptr = calloc(size, 1);
-    if(!ptr){
-        perror("Memory Allocation Error");
-        exit(EXIT_FAILURE);
+    ssize_t status;
+    uint32_t crc = CRC_INIT;
+    size_t len;
+    
+    switch(medium->mode) {
+        case MEDIUM_RING:
+            status = ring_read(medium, cursor, buf, size, &len, &crc);
+            if(!status && len != size)
+                return EBADMSG;
+            break;
+        case MEDIUM_BULK:
+            status = bulkread(medium, buf, size, &crc);
+            break;
+        default:
+            status = slowread(medium, buf, size, &crc);
+            break;
     }
-    return ptr;
+    if(!status && crc != CRC_RESIDUE)
+        return EBADMSG;
+    return status;
 }
 
-void *ralloc(void *ptr, size_t size)
+/* Returns EMSGSIZE, with nothing published, for a frame longer than the medium */
+int medium_write(medium_s *medium, void *buf, size_t size)
 {
-    ptr = realloc(ptr, size);
-    if(!ptr){
-        perror("Memory Allocation Error");
-        exit(EXIT_FAILURE);
+    switch(medium->mode) {
+        case MEDIUM_RING:
+            return ring_write(medium, buf, size);
+        case MEDIUM_BULK:
+            return bulkwrite(medium, buf, size);
+        default:
+            return slowwrite(medium, buf, size);
     }
-    return ptr;
-}
\ No newline at end of file
+}
+
+/* Release what has been read so far so writers can reuse it */
+void medium_consume(medium_s *medium, uint64_t cursor)
+{
+    if(medium->mode == MEDIUM_RING) {
+        if(!medium->broadcast)
+            __atomic_store_n(&medium->tail, cursor, __ATOMIC_RELEASE);
+    }
+    else {
+        medium->size = 0;
+    }
+}
+
+/*
+ Read one whole frame at cursor, truncated to size. len is set to the
+ length the frame was published with, which may differ from size.
+ */
+ssize_t ring_read(medium_s *medium, uint64_t *cursor, void *buf, size_t size, size_t *len, uint32_t *crc)
+{
+    slot_s *slot;
+    uint64_t seq;
+    uint32_t seen, c = 0;
+    size_t n, published;
+    timer_s timer;
+    
+    timer_start(&timer, WAIT_TIME);
+    while(true) {
+        seen = __atomic_load_n(&medium->size, __ATOMIC_ACQUIRE);
+        slot = medium_slot(medium, *cursor);
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if(seq == *cursor + 1) {
+            published = slot->size;
+            n = published < size ? published : size;
+            if(crc)
+                c = crc_copy(*crc, buf, slot->data, n);
+            else
+                memcpy(buf, slot->data, n);
+            
+            /* writer may have lapped us while copying */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq) {
+                if(crc)
+                    *crc = c;
+                *len = published;
+                (*cursor)++;
+                break;
+            }
+        }
+        else if(seq > *cursor + 1) {
+            *cursor = __atomic_load_n(&medium->head, __ATOMIC_ACQUIRE);
+            continue;
+        }
+        if(timer_expired(&timer)) {
+            /* writer claimed the slot but never published it */
+            if(!medium->broadcast && __atomic_load_n(&medium->head, __ATOMIC_ACQUIRE) > *cursor)
+                (*cursor)++;
+            return EINTR;
+        }
+        shm_wait(&medium->size, seen, &medium->size_waiters, medium->spin, WAIT_SLICE);
+    }
+    timer_cancel(&timer);
+    return 0;
+}
+
+/* Publish one whole frame, or lose it if the ring is full */
+int ring_write(medium_s *medium, void *buf, size_t size)
+{
+    slot_s *slot;
+    uint64_t pos;
+    
+    if(size > medium->capacity)
+        return EMSGSIZE;
+    slot = medium_claim(medium, &pos);
+    if(!slot)
+        return 0;
+    
+    memcpy(slot->data, buf, size);
+    medium_publish(medium, slot, pos, size);
+    return 0;
+}
+
+/*
+ Claim the slot at head so a frame can be built in place. Returns
+ NULL if the ring is full. Every claimed slot must be published,
+ with size 0 if the frame turned out to be unusable.
+ */
+slot_s *medium_claim(medium_s *medium, uint64_t *pos)
+{
+    slot_s *slot;
+    
+    *pos = __atomic_load_n(&medium->head, __ATOMIC_RELAXED);
+    do {
+        if(!medium->broadcast &&
+           *pos - __atomic_load_n(&medium->tail, __ATOMIC_ACQUIRE) >= medium->nslots)
+            return NULL;
+    }
+    while(!__atomic_compare_exchange_n(&medium->head, pos, *pos + 1, true,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    
+    slot = medium_slot(medium, *pos);
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return slot;
+}
+
+void medium_publish(medium_s *medium, slot_s *slot, uint64_t pos, size_t size)
+{
+    slot->size = size;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+    
+    __atomic_fetch_add(&medium->size, 1, __ATOMIC_SEQ_CST);
+    shm_wake(&medium->size, &medium->size_waiters);
+}
+
+/* The published frame at cursor, read in place; NULL if none yet */
+slot_s *medium_peek(medium_s *medium, uint64_t cursor)
+{
+    slot_s *slot = medium_slot(medium, cursor);
+    
+    if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == cursor + 1)
+        return slot;
+    return NULL;
+}
+
+/* Read a whole frame once its last byte is published */
+ssize_t bulkread(medium_s *medium, void *buf, size_t size, uint32_t *crc)
+{
+    ssize_t status;
+    timer_s timer;
+    
+    timer_start(&timer, WAIT_TIME);
+    status = read_shm(medium, buf, 0, size, &timer, crc);
+    timer_cancel(&timer);
+    return status;
+}
+
+/* Copy a whole frame, then publish it with a single store of size */
+int bulkwrite(medium_s *medium, void *buf, size_t size)
+{
+    int status;
+    
+    medium->size = 0;
+    status = write_shm(medium, buf, size);
+    if(status)
+        return status;
+    __atomic_store_n(&medium->size, size, __ATOMIC_SEQ_CST);
+    shm_wake(&medium->size, &medium->size_waiters);
+    return 0;
+}
@@ -5,29 +5,53 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <time.h>
 
 #include <signal.h>
 #include <pthread.h>
 
-#define SHM_KEY_C 0xDEADBEAC
-#define SHM_KEY_S 0xDEADBEA5
-#define CRC_POLYNOMIAL 0x11EDC6F41
+#include "timer.h"
+#include "crc.h"
+#include "log.h"
+#include "alloc.h"
+
+#define SHM_PREFIX "csma"
+#define SHM_NAME_SIZE 64
+#define HUGE_DIR "/dev/hugepages"
+#define HUGE_PAGE_SIZE (2*1024*1024)
+#define MAX_CHANNELS 64
+#define MAX_STATIONS 4096
+#define ADDR_SIZE 6
 
 #define MEDIUM_SIZE 2048
+#define MEDIUM_SLOTS 32
+#define CACHE_LINE 64
 #define WAIT_TIME 2.0
+#define CMD_FIELDS 3
+#define CMD_TEXT_SIZE 256
+#define CMD_ALIGN 8
+#define WAIT_SLICE 0.1
+#define SPIN_BUDGET 1000
 #define TIME_SLOT 100
 #define RTS_SIZE 1000
 #define CTS_ACK_SIZE 14
 #define RTS_SUBTYPE 0x0b00
 #define CTS_SUBTYPE 0x0c00
 #define ACK_SUBTYPE 0x0d00
+#define FC_AGGREGATE 0x0001
+#define AGG_MAX 64
+#define AGG_HEADER sizeof(uint16_t)
 
 typedef enum funcs_e funcs_e;
+typedef enum medium_mode_e medium_mode_e;
 typedef struct rts_s rts_s;
 typedef struct cts_ack_s cts_ack_s;
 typedef struct frame_s frame_s;
-typedef struct timerarg_s timerarg_s;
+typedef struct slot_s slot_s;
 typedef struct medium_s medium_s;
+typedef struct ready_s ready_s;
+typedef struct cmd_s cmd_s;
 
 enum funcs_e {
     FNET_SEND,
@@ -39,6 +63,12 @@ enum funcs_e {
     FNET_RECEIVE
 };
 
+enum medium_mode_e {
+    MEDIUM_SLOW,
+    MEDIUM_BULK,
+    MEDIUM_RING
+};
+
 struct rts_s
 {
     uint16_t FC;
@@ -63,17 +93,85 @@ struct frame_s
     char payload[];
 };
 
-struct timerarg_s
+/*
+ A frame slot in a ring medium. seq is the ring position + 1
+ once the frame is published, 0 while it is being written.
+ Slots are slot_stride bytes apart.
+ */
+struct slot_s
 {
-    double time;
-    pthread_t sender;
+    uint64_t seq;
+    size_t size;
+    char data[];
 };
 
+/*
+ In MEDIUM_SLOW mode frames are streamed byte by byte through buf
+ and collide with each other. MEDIUM_BULK uses the same stream but
+ copies and publishes each frame whole. In MEDIUM_RING mode each write claims
+ a whole slot at head. A broadcast medium has one writer and any
+ number of readers that each keep their own cursor; otherwise the
+ single reader publishes its cursor as tail and writers drop frames
+ when the ring is full. In ring mode size counts published frames.
+ 
+ The stream buffer holds capacity bytes and is followed by nslots
+ slots of capacity bytes each, starting at buf + slots.
+ 
+ agg_count and agg_bytes on an uplink limit how many payloads, and
+ how many bytes of them, a station may aggregate behind one RTS.
+ 
+ isbusy and size are futex words. Waiters spin for spin iterations
+ before sleeping and announce themselves in the matching *_waiters
+ count so writers only make the wake syscall when someone sleeps.
+ */
 struct medium_s
 {
-    bool isbusy;
-    size_t size;
-    char buf[MEDIUM_SIZE];
+    uint32_t isbusy;
+    uint32_t size;
+    uint32_t busy_waiters;
+    uint32_t size_waiters;
+    uint32_t spin;
+    uint32_t agg_count;
+    uint32_t agg_bytes;
+    medium_mode_e mode;
+    bool broadcast;
+    uint64_t head;
+    uint64_t tail;
+    size_t capacity;
+    size_t nslots;
+    size_t slot_stride;
+    size_t slots;
+    char buf[];
+};
+
+/*
+ Start-up barrier shared by the AP and its clients. Each client bumps
+ count once its mediums are mapped; the AP waits on it as a futex word
+ for every process it spawned.
+ */
+struct ready_s
+{
+    uint32_t count;
+    uint32_t waiters;
+};
+
+/*
+ A command record in a client's mailbox, a non-broadcast ring medium
+ the AP posts to and the client drains. len[] gives the sizes of the
+ fields packed in data: name, ifs and PRNG seed for FNET_NODE, dst,
+ payload and period for FNET_SEND, none for FNET_KILL. Strings keep
+ their '\0'. A slot carries a bundle of records back to back, each
+ size bytes rounded up to CMD_ALIGN.
+ */
+struct cmd_s
+{
+    uint32_t size;
+    funcs_e func;
+    int channel;
+    int id;
+    bool repeat;
+    uint32_t len[CMD_FIELDS];
+    char data[];
 };
 
 extern FILE *logfile;
@@ -83,21 +181,36 @@ extern size_t name_len;
 extern medium_s *mediums;
 extern medium_s *mediumc;
 
-extern ssize_t slowread(medium_s *medium, void *buf, size_t size);
-extern void slowwrite(medium_s *medium, void *data, size_t size);
-extern pthread_t timer_thread;
+extern ssize_t slowread(medium_s *medium, void *buf, size_t size, uint32_t *crc);
+extern int slowwrite(medium_s *medium, void *data, size_t size);
+
+extern size_t medium_bytes(size_t capacity);
+extern void medium_init(medium_s *medium, medium_mode_e mode, bool broadcast, uint32_t spin, size_t capacity);
+extern uint64_t medium_mark(medium_s *medium);
+extern ssize_t medium_read(medium_s *medium, uint64_t *cursor, void *buf, size_t size);
+extern ssize_t medium_read_fcs(medium_s *medium, uint64_t *cursor, void *buf, size_t size);
+extern int medium_write(medium_s *medium, void *buf, size_t size);
+extern void medium_consume(medium_s *medium, uint64_t cursor);
+extern slot_s *medium_claim(medium_s *medium, uint64_t *pos);
+extern void medium_publish(medium_s *medium, slot_s *slot, uint64_t pos, size_t size);
+extern slot_s *medium_peek(medium_s *medium, uint64_t cursor);
 
 extern size_t write_shm(medium_s *medium, char *data, size_t size);
-extern size_t read_shm(medium_s *medium, char *data, size_t start, size_t size);
+extern size_t read_shm(medium_s *medium, char *data, size_t start, size_t size, timer_s *timer, uint32_t *crc);
 
 extern void set_busy(medium_s *medium, bool isbusy);
+extern void wait_idle(medium_s *medium, volatile bool *stop);
+
+extern void shm_name(char *buf, const char *run, char kind, int channel);
+extern void *shm_create(const char *name, size_t size, bool huge);
+extern void *shm_attach(const char *name);
+extern void shm_remove(const char *name);
+
+extern void shm_wait(uint32_t *word, uint32_t val, uint32_t *waiters, uint32_t spin, double timeout);
+extern void shm_wake(uint32_t *word, uint32_t *waiters);
 
 extern bool addr_cmp(char *addr1, char *addr2);
-extern void start_timer(double time);
-extern void logevent(char *fs, ...);
+extern void snooze(const struct timespec *ts);
 extern void sigALARM(int sig);
-extern void *alloc(size_t size);
-extern void *allocz(size_t size);
-extern void *ralloc(void *ptr, size_t size);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,799 @@
+/* Discrete event engine: the CSMA/CA exchange run against a virtual clock */
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <math.h>
+
+#include "sim.h"
+#include "parse.h"
+#include "traffic.h"
+#include "trace.h"
+
+typedef struct sim_station_s sim_station_s;
+typedef struct sim_flow_s sim_flow_s;
+typedef struct sim_channel_s sim_channel_s;
+typedef struct sim_part_s sim_part_s;
+
+enum sim_events_e {
+    EV_SENSE,
+    EV_IFS,
+    EV_RTS_END,
+    EV_CTS_END,
+    EV_DATA_START,
+    EV_DATA_END,
+    EV_ACK_END,
+    EV_TIMEOUT,
+    EV_RECEIVE
+};
+
+enum sim_state_e {
+    FLOW_DELAY,
+    FLOW_SENSE,
+    FLOW_IFS,
+    FLOW_RTS,
+    FLOW_CTS_WAIT,
+    FLOW_DATA,
+    FLOW_ACK_WAIT,
+    FLOW_BACKOFF,
+    FLOW_DONE
+};
+
+struct sim_station_s
+{
+    char *id;
+    char *name;
+    uint32_t index;
+    FILE *log;
+    double ifs;
+    int channel;
+    bool dead;
+    rng_s rng;
+    uint64_t goodput_frames;
+    uint64_t goodput_bytes;
+};
+
+/* One send() from the script, the equivalent of a client send thread */
+struct sim_flow_s
+{
+    sim_station_s *station;
+    char *dst;
+    char *payload;
+    size_t size;
+    traffic_s traffic;
+    bool repeat;
+    double start;
+    double due;
+    uint64_t offered;
+    uint64_t sent;
+    uint64_t failed;
+    uint64_t overrun;
+    int K, R;
+    int state;
+    uint32_t gen;
+    bool corrupt;
+    sim_flow_s *next;
+    sim_flow_s *tx_next;
+    sim_flow_s *all;
+};
+
+/*
+ The AP side of a channel. nav is the busy flag the AP holds for the
+ length of an exchange; onair counts frames currently being sent in
+ either direction, uplink lists the ones heading to the AP so that
+ overlapping frames can be marked as collided.
+ */
+struct sim_channel_s
+{
+    sim_part_s *part;
+    int onair;
+    int starting;
+    double start_time;
+    bool nav;
+    sim_flow_s *uplink;
+    sim_flow_s *waiters;
+    sim_flow_s **waiters_tail;
+    sim_flow_s *listeners;
+};
+
+/*
+ A set of channels with its own event queue and thread. Partitions only
+ meet when a payload is delivered to a station on another channel, which
+ takes effect lookahead later, so each can run a window of lookahead
+ ahead of the slowest without ever receiving an event in its past.
+ */
+struct sim_part_s
+{
+    int id;
+    int nchannels;
+    sim_queue_s queue;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    sim_event_s *incoming;
+    size_t nincoming;
+    size_t bincoming;
+    double next;
+    double stall;
+    uint64_t windows;
+    struct {
+        uint64_t events;
+        uint64_t delivered;
+        uint64_t collisions;
+        uint64_t timeouts;
+    } stats;
+};
+
+static sim_part_s *parts;
+static int nparts;
+static double lookahead;
+static double horizon;
+static pthread_barrier_t barrier;
+static __thread sim_part_s *part;
+
+static sim_channel_s *channels;
+static uint64_t run_seed;
+static int nchannels;
+static size_t capacity;
+static sym_table_s stations;
+static int nstations;
+static double min_ifs;
+static sim_flow_s *flows;
+
+static void sim_push(sim_queue_s *q, double time, int type, void *obj, uint32_t gen);
+static bool sim_pop(sim_queue_s *q, sim_event_s *ev);
+static void sim_log(FILE *f, const char *name, const char *fs, ...);
+static void sim_trace(int type, uint32_t station, const char *peer, int K, int R, uint32_t size);
+static void sim_node(char *id, char *ifs, char *channel, char *seed);
+static void sim_send(send_s *send);
+static void sim_kill(char *id);
+static void *sim_worker(void *arg);
+static void sim_sync(void);
+static void sim_forward(sim_flow_s *f, sim_station_s *dst);
+static void sim_event(sim_event_s *ev);
+static double airtime(size_t bytes);
+static bool channel_busy(sim_channel_s *ch);
+static void channel_idle(sim_channel_s *ch);
+static void flow_listen(sim_channel_s *ch, sim_flow_s *f);
+static void channel_hear(sim_channel_s *ch, sim_flow_s *owner, int type);
+static void tx_start(sim_channel_s *ch, sim_flow_s *f);
+static void tx_end(sim_channel_s *ch, sim_flow_s *f);
+static void flow_delay(sim_flow_s *f);
+static void flow_sense(sim_flow_s *f);
+static void flow_backoff(sim_flow_s *f);
+static void flow_done(sim_flow_s *f, bool acked);
+
+/*
+ Build the stations and flows queued by the script, then run events on
+ np partitions until the queues drain or the virtual clock passes duration.
+ */
+void sim_run(double duration, int nch, size_t cap, int np, uint64_t seed)
+{
+    int i;
+    task_s *t;
+    sim_flow_s *f;
+    sym_record_s *rec;
+    sim_station_s *s;
+    sim_part_s *pt;
+    struct timespec start, end;
+    double wall;
+    uint64_t events = 0, delivered = 0, collisions = 0, timeouts = 0, bytes = 0;
+    
+    nchannels = nch;
+    capacity = cap;
+    run_seed = seed;
+    horizon = duration;
+    nparts = np < nch ? np : nch;
+    parts = allocz(nparts*sizeof(*parts));
+    for(i = 0; i < nparts; i++) {
+        parts[i].id = i;
+        pthread_mutex_init(&parts[i].lock, NULL);
+    }
+    channels = allocz(nchannels*sizeof(*channels));
+    for(i = 0; i < nchannels; i++) {
+        channels[i].part = &parts[i % nparts];
+        channels[i].part->nchannels++;
+        channels[i].waiters_tail = &channels[i].waiters;
+    }
+    part = &parts[0];
+    
+    while((t = task_dequeue())) {
+        switch(t->func) {
+            case FNET_NODE:
+                sim_node(*(char **)(t + 1), *((char **)(t + 1) + 1), *((char **)(t + 1) + 2),
+                         *((char **)(t + 1) + 3));
+                break;
+            case FNET_SEND:
+                sim_send((send_s *)t);
+                break;
+            case FNET_KILL:
+                sim_kill(*(char **)(t + 1));
+            default:
+                break;
+        }
+        free(t);
+    }
+    
+    /* the shortest gap before any station can react to a forwarded frame */
+    lookahead = min_ifs + SIM_SLOT_TIME;
+    
+    pthread_barrier_init(&barrier, NULL, nparts);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(i = 1; i < nparts; i++) {
+        if(pthread_create(&parts[i].thread, NULL, sim_worker, &parts[i])) {
+            perror("Failed to create simulation thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sim_worker(&parts[0]);
+    for(i = 1; i < nparts; i++)
+        pthread_join(parts[i].thread, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    wall = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)*1e-9;
+    pthread_barrier_destroy(&barrier);
+    
+    /*
+     each partition's clock stops at its own last event, so the reports
+     are stamped with the end of the run instead, whatever -P was
+     */
+    part = &parts[0];
+    part->queue.now = duration;
+    for(i = 0; i < nparts; i++) {
+        pt = &parts[i];
+        sim_log(logfile, "ap", "Partition %d: %d channels, %llu events (%.0f/s), %llu windows, %.3f s stalled",
+                i, pt->nchannels, (unsigned long long)pt->stats.events,
+                wall > 0 ? pt->stats.events/wall : 0.0, (unsigned long long)pt->windows, pt->stall);
+        events += pt->stats.events;
+        delivered += pt->stats.delivered;
+        collisions += pt->stats.collisions;
+        timeouts += pt->stats.timeouts;
+    }
+    sim_log(logfile, "ap", "Simulated %.3f s in %.3f s: %llu events (%.0f/s), %llu delivered, %llu collisions, %llu timeouts",
+            duration, wall, (unsigned long long)events, wall > 0 ? events/wall : 0.0,
+            (unsigned long long)delivered, (unsigned long long)collisions, (unsigned long long)timeouts);
+    printf("Simulated %.3f s in %.3f s on %d partition(s), lookahead %.6f s: %llu events, %llu delivered\n",
+           duration, wall, nparts, lookahead, (unsigned long long)events, (unsigned long long)delivered);
+    
+    for(f = flows; f; f = f->all) {
+        s = f->station;
+        if(!f->repeat || duration <= f->start)
+            continue;
+        if(f->traffic.kind == TRAFFIC_SATURATE) {
+            sim_log(s->log, s->name, "Flow to %s: saturated, achieved %.3f/s (%llu sent, %llu failed)",
+                    f->dst, f->sent/(duration - f->start), (unsigned long long)f->sent, (unsigned long long)f->failed);
+        }
+        else {
+            sim_log(s->log, s->name, "Flow to %s: offered %.3f/s, achieved %.3f/s (%llu offered, %llu sent, %llu failed, %llu overrun)",
+                    f->dst, f->offered/(duration - f->start), f->sent/(duration - f->start),
+                    (unsigned long long)f->offered, (unsigned long long)f->sent,
+                    (unsigned long long)f->failed, (unsigned long long)f->overrun);
+        }
+    }
+    while(flows) {
+        f = flows->all;
+        traffic_free(&flows->traffic);
+        free(flows);
+        flows = f;
+    }
+    for(i = 0; i < SYM_TABLE_SIZE; i++) {
+        for(rec = stations.table[i]; rec; rec = rec->next) {
+            s = rec->data.ptr;
+            sim_log(s->log, s->name, "Goodput: %.3f frames/s, %.3f kbit/s (%llu frames, %llu bytes in %.3f s)",
+                    s->goodput_frames/duration, s->goodput_bytes*8e-3/duration,
+                    (unsigned long long)s->goodput_frames, (unsigned long long)s->goodput_bytes, duration);
+            bytes += s->goodput_bytes;
+            fclose(s->log);
+            free(s->name);
+            free(s);
+        }
+    }
+    sim_log(logfile, "ap", "Goodput: %.3f frames/s, %.3f kbit/s (%llu frames, %llu bytes in %.3f s)",
+            delivered/duration, bytes*8e-3/duration, (unsigned long long)delivered, (unsigned long long)bytes, duration);
+    printf("Goodput: %.3f frames/s, %.3f kbit/s over %.3f s\n", delivered/duration, bytes*8e-3/duration, duration);
+    for(i = 0; i < nparts; i++) {
+        pthread_mutex_destroy(&parts[i].lock);
+        free(parts[i].queue.heap);
+        free(parts[i].incoming);
+    }
+    free(parts);
+    free(channels);
+}
+
+/*
+ Conservative windows: every partition agrees on the earliest pending
+ event, then runs everything before it plus lookahead. Frames forwarded
+ during a window land at or after its end, so they are merged in before
+ the next one starts.
+ */
+void *sim_worker(void *arg)
+{
+    int i;
+    size_t n;
+    double first, end;
+    sim_event_s ev;
+    
+    part = arg;
+    while(true) {
+        pthread_mutex_lock(&part->lock);
+        for(n = 0; n < part->nincoming; n++) {
+            ev = part->incoming[n];
+            sim_push(&part->queue, ev.time, ev.type, ev.obj, ev.gen);
+        }
+        part->nincoming = 0;
+        pthread_mutex_unlock(&part->lock);
+        part->next = part->queue.size ? part->queue.heap[0].time : INFINITY;
+        sim_sync();
+        
+        first = INFINITY;
+        for(i = 0; i < nparts; i++)
+            if(parts[i].next < first)
+                first = parts[i].next;
+        if(first > horizon)
+            break;
+        
+        end = first + lookahead;
+        while(part->queue.size && part->queue.heap[0].time < end && part->queue.heap[0].time <= horizon) {
+            sim_pop(&part->queue, &ev);
+            part->queue.now = ev.time;
+            sim_event(&ev);
+            part->stats.events++;
+        }
+        part->windows++;
+        sim_sync();
+    }
+    return NULL;
+}
+
+/* Barrier between windows, charged to the partition as stall time */
+void sim_sync(void)
+{
+    struct timespec a, b;
+    
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    pthread_barrier_wait(&barrier);
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    part->stall += (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec)*1e-9;
+}
+
+/* A payload for a station on another channel arrives lookahead later */
+void sim_forward(sim_flow_s *f, sim_station_s *dst)
+{
+    sim_part_s *to = channels[dst->channel].part;
+    double time = part->queue.now + lookahead;
+    
+    if(to == part) {
+        sim_push(&part->queue, time, EV_RECEIVE, f, 0);
+        return;
+    }
+    
+    pthread_mutex_lock(&to->lock);
+    if(to->nincoming == to->bincoming) {
+        to->bincoming = to->bincoming ? 2*to->bincoming : 64;
+        to->incoming = ralloc(to->incoming, to->bincoming*sizeof(*to->incoming));
+    }
+    to->incoming[to->nincoming++] = (sim_event_s){time, 0, EV_RECEIVE, 0, f};
+    pthread_mutex_unlock(&to->lock);
+}
+
+void sim_push(sim_queue_s *q, double time, int type, void *obj, uint32_t gen)
+{
+    size_t i, p;
+    sim_event_s ev = {time, q->seq++, type, gen, obj};
+    
+    if(q->size == q->bsize) {
+        q->bsize = q->bsize ? 2*q->bsize : 64;
+        q->heap = ralloc(q->heap, q->bsize*sizeof(*q->heap));
+    }
+    
+    for(i = q->size++; i; i = p) {
+        p = (i-1)/2;
+        if(q->heap[p].time < time || (q->heap[p].time == time && q->heap[p].seq < ev.seq))
+            break;
+        q->heap[i] = q->heap[p];
+    }
+    q->heap[i] = ev;
+}
+
+bool sim_pop(sim_queue_s *q, sim_event_s *ev)
+{
+    size_t i, c;
+    sim_event_s last;
+    
+    if(!q->size)
+        return false;
+    *ev = q->heap[0];
+    last = q->heap[--q->size];
+    
+    for(i = 0; (c = 2*i+1) < q->size; i = c) {
+        if(c+1 < q->size && (q->heap[c+1].time < q->heap[c].time ||
+           (q->heap[c+1].time == q->heap[c].time && q->heap[c+1].seq < q->heap[c].seq)))
+            c++;
+        if(last.time < q->heap[c].time || (last.time == q->heap[c].time && last.seq < q->heap[c].seq))
+            break;
+        q->heap[i] = q->heap[c];
+    }
+    q->heap[i] = last;
+    return true;
+}
+
+/* Same layout as logevent, stamped with the virtual clock */
+void sim_log(FILE *f, const char *name, const char *fs, ...)
+{
+    va_list args;
+    double t = part->queue.now;
+    int h, m;
+    
+    h = (int)(t/3600);
+    t -= h*3600.0;
+    m = (int)(t/60);
+    t -= m*60.0;
+    
+    /* the AP log is shared by every partition */
+    flockfile(f);
+    fprintf(f, "%.6s:\t%02d:%02d:%09.6f:\t", name, h, m, t);
+    
+    va_start(args, fs);
+    vfprintf(f, fs, args);
+    va_end(args);
+    
+    fputc('\n', f);
+    funlockfile(f);
+}
+
+/* Trace records carry the virtual clock, in ns from the start of the run */
+void sim_trace(int type, uint32_t station, const char *peer, int K, int R, uint32_t size)
+{
+    if(trace)
+        trace_at(part ? (uint64_t)(part->queue.now*1e9) : 0, type, station, peer, K, R, size);
+}
+
+/* Seeded as the AP seeds live stations, so a name draws the same stream */
+void sim_node(char *id, char *ifs, char *channel, char *seed)
+{
+    sim_station_s *s;
+    int ch = atoi(channel);
+    char outfile[SHM_NAME_SIZE];
+    
+    if(ch < 0 || ch >= nchannels) {
+        fprintf(stderr, "Node %s: channel %d out of range, only %d channel(s) configured\n", id, ch, nchannels);
+        return;
+    }
+    if(sym_lookup(&stations, id))
+        return;
+    
+    s = allocz(sizeof(*s));
+    s->id = id;
+    s->name = strndup(&id[1], strlen(id)-2);
+    s->ifs = strtod(ifs, NULL);
+    s->channel = ch;
+    rng_seed(&s->rng, rng_mix(seed ? strtoull(seed, NULL, 0) : run_seed, id));
+    s->index = nstations;
+    if(!nstations++ || s->ifs < min_ifs)
+        min_ifs = s->ifs;
+    sim_trace(TRACE_NODE, s->index, s->name, s->channel, 0, 0);
+    
+    snprintf(outfile, sizeof(outfile), "out/%s", s->name);
+    s->log = fopen(outfile, "w");
+    if(!s->log) {
+        perror("Error Creating file for redirection");
+        exit(EXIT_FAILURE);
+    }
+    sym_insert(&stations, id, (sym_data_u){.ptr = s});
+    printf("Successfully Started Station: %s\n", id);
+}
+
+void sim_send(send_s *send)
+{
+    sym_record_s *rec;
+    sim_flow_s *f;
+    
+    rec = sym_lookup(&stations, send->src);
+    if(!rec)
+        return;
+    if(send->size + sizeof(uint32_t) > capacity)
+        sim_log(logfile, "ap", "Payload of %zu bytes from %s exceeds medium capacity %zu", send->size, send->src, capacity);
+    
+    f = allocz(sizeof(*f));
+    f->station = rec->data.ptr;
+    f->dst = send->dst;
+    f->payload = send->payload;
+    f->size = send->size;
+    if(!traffic_parse(&f->traffic, send->period))
+        traffic_parse(&f->traffic, "0");
+    f->repeat = send->repeat;
+    f->all = flows;
+    flows = f;
+    part = channels[f->station->channel].part;
+    f->start = part->queue.now;
+    f->due = f->start + traffic_start(&f->traffic, rng_unit(&f->station->rng));
+    f->offered = 1;
+    flow_delay(f);
+}
+
+/* Flows of a killed station stop at their next attempt */
+void sim_kill(char *id)
+{
+    sym_record_s *rec = sym_lookup(&stations, id);
+    
+    if(rec)
+        ((sim_station_s *)rec->data.ptr)->dead = true;
+}
+
+void sim_event(sim_event_s *ev)
+{
+    sim_flow_s *f = ev->obj;
+    sim_station_s *s = f->station, *dst;
+    sim_channel_s *ch = &channels[s->channel];
+    sym_record_s *rec;
+    
+    switch(ev->type) {
+        case EV_RECEIVE:
+            dst = sym_lookup(&stations, f->dst)->data.ptr;
+            sim_log(dst->log, dst->name, "Received Message %.*s from %.6s", (int)f->size, f->payload, s->name);
+            break;
+        case EV_SENSE:
+            if(s->dead)
+                f->state = FLOW_DONE;
+            else
+                flow_sense(f);
+            break;
+        case EV_IFS:
+            if(channel_busy(ch)) {
+                flow_sense(f);
+                break;
+            }
+            f->R = rng_below(&s->rng, 1u << f->K);
+            f->state = FLOW_RTS;
+            tx_start(ch, f);
+            sim_log(s->log, s->name, "%s sent RTS", s->name);
+            sim_trace(TRACE_RTS_TX, s->index, f->dst, f->K, f->R, f->size);
+            sim_push(&part->queue, part->queue.now + airtime(sizeof(rts_s)), EV_RTS_END, f, 0);
+            break;
+        case EV_RTS_END:
+            tx_end(ch, f);
+            flow_listen(ch, f);
+            if(f->corrupt) {
+                sim_log(logfile, "ap", "Checksum Validation Failed for suspected RTS");
+                sim_trace(TRACE_FCS_ERROR, TRACE_AP, NULL, s->channel, 0, 0);
+            }
+            else if(!ch->nav) {
+                /* answer with a CTS, holding the channel until the ACK */
+                ch->nav = true;
+                ch->onair++;
+                sim_log(logfile, "ap", "Got Valid RTS and Sent ACK");
+                sim_push(&part->queue, part->queue.now + airtime(sizeof(cts_ack_s)), EV_CTS_END, f, 0);
+            }
+            channel_idle(ch);
+            break;
+        case EV_CTS_END:
+            ch->onair--;
+            channel_hear(ch, f, CTS_SUBTYPE);
+            break;
+        case EV_DATA_START:
+            f->state = FLOW_DATA;
+            tx_start(ch, f);
+            sim_log(s->log, s->name, "Sent Payload");
+            sim_trace(TRACE_DATA_TX, s->index, f->dst, f->K, f->R, f->size);
+            sim_push(&part->queue, part->queue.now + airtime(f->size + sizeof(uint32_t)), EV_DATA_END, f, 0);
+            break;
+        case EV_DATA_END:
+            tx_end(ch, f);
+            flow_listen(ch, f);
+            if(f->corrupt) {
+                sim_log(logfile, "ap", "Checksum Validation FAiled for payload");
+                sim_trace(TRACE_FCS_ERROR, TRACE_AP, s->name, s->channel, 0, f->size);
+                ch->nav = false;
+                channel_idle(ch);
+                break;
+            }
+    
+            rec = sym_lookup(&stations, f->dst);
+            dst = rec ? rec->data.ptr : NULL;
+            if(dst && !dst->dead) {
+                sim_log(logfile, "ap", "Delivered payload to %.6s", dst->name);
+                sim_trace(TRACE_DELIVER, TRACE_AP, s->name, s->channel, 0, f->size);
+                if(dst->channel == s->channel)
+                    sim_log(dst->log, dst->name, "Received Message %.*s from %.6s", (int)f->size, f->payload, s->name);
+                else
+                    sim_forward(f, dst);
+                part->stats.delivered++;
+            }
+            else {
+                sim_log(logfile, "ap", "Unknown Station: %.*s", (int)strlen(f->dst)-2, &f->dst[1]);
+            }
+            ch->onair++;
+            sim_log(logfile, "ap", "Got Valid RTS and Sent ACK");
+            sim_push(&part->queue, part->queue.now + airtime(sizeof(cts_ack_s)), EV_ACK_END, f, 0);
+            break;
+        case EV_ACK_END:
+            ch->onair--;
+            ch->nav = false;
+            channel_hear(ch, f, ACK_SUBTYPE);
+            channel_idle(ch);
+            break;
+        case EV_TIMEOUT:
+            if(ev->gen != f->gen)
+                break;
+            part->stats.timeouts++;
+            channel_hear(ch, f, 0);
+            break;
+    }
+}
+
+double airtime(size_t bytes)
+{
+    return bytes*SIM_BYTE_TIME;
+}
+
+/* A frame that starts this very instant cannot be heard yet */
+bool channel_busy(sim_channel_s *ch)
+{
+    int fresh = ch->start_time == part->queue.now ? ch->starting : 0;
+    
+    return ch->nav || ch->onair > fresh;
+}
+
+/* Release stations blocked in wait_idle once nothing holds the channel */
+void channel_idle(sim_channel_s *ch)
+{
+    sim_flow_s *f, *next;
+    
+    if(ch->nav || ch->onair)
+        return;
+    
+    f = ch->waiters;
+    ch->waiters = NULL;
+    ch->waiters_tail = &ch->waiters;
+    for(; f; f = next) {
+        next = f->next;
+        f->state = FLOW_IFS;
+        sim_push(&part->queue, part->queue.now + f->station->ifs, EV_IFS, f, 0);
+    }
+}
+
+/* Wait on the downlink for a CTS or ACK, giving up after WAIT_TIME */
+void flow_listen(sim_channel_s *ch, sim_flow_s *f)
+{
+    f->state = f->state == FLOW_RTS ? FLOW_CTS_WAIT : FLOW_ACK_WAIT;
+    f->next = ch->listeners;
+    ch->listeners = f;
+    sim_push(&part->queue, part->queue.now + WAIT_TIME, EV_TIMEOUT, f, ++f->gen);
+}
+
+/*
+ Deliver a CTS or ACK for owner to every flow reading the downlink.
+ Like check_ack_cts, anyone else backs off; type 0 is owner's timeout.
+ */
+void channel_hear(sim_channel_s *ch, sim_flow_s *owner, int type)
+{
+    sim_flow_s **p, *f;
+    
+    for(p = &ch->listeners; (f = *p); ) {
+        if(type == 0 && f != owner) {
+            p = &f->next;
+            continue;
+        }
+        *p = f->next;
+        f->gen++;
+    
+        if(f != owner || type == 0) {
+            flow_backoff(f);
+        }
+        else if(type == CTS_SUBTYPE) {
+            sim_log(f->station->log, f->station->name, "GOT CTS");
+            sim_trace(TRACE_CTS_RX, f->station->index, f->dst, f->K, f->R, f->size);
+            sim_push(&part->queue, part->queue.now + f->station->ifs, EV_DATA_START, f, 0);
+        }
+        else {
+            sim_log(f->station->log, f->station->name, "Got Ack");
+            sim_trace(TRACE_ACK_RX, f->station->index, f->dst, f->K, f->R, f->size);
+            flow_done(f, true);
+        }
+    }
+}
+
+void tx_start(sim_channel_s *ch, sim_flow_s *f)
+{
+    sim_flow_s *o;
+    
+    f->corrupt = false;
+    for(o = ch->uplink; o; o = o->tx_next) {
+        if(!o->corrupt)
+            part->stats.collisions++;
+        o->corrupt = f->corrupt = true;
+    }
+    f->tx_next = ch->uplink;
+    ch->uplink = f;
+    ch->onair++;
+    
+    if(ch->start_time != part->queue.now) {
+        ch->start_time = part->queue.now;
+        ch->starting = 0;
+    }
+    ch->starting++;
+}
+
+void tx_end(sim_channel_s *ch, sim_flow_s *f)
+{
+    sim_flow_s **p;
+    
+    for(p = &ch->uplink; *p != f; p = &(*p)->tx_next)
+        ;
+    *p = f->tx_next;
+    ch->onair--;
+}
+
+/* Wait for the flow's next arrival, as the station's MAC loop does */
+void flow_delay(sim_flow_s *f)
+{
+    f->K = 0;
+    f->state = FLOW_DELAY;
+    sim_push(&part->queue, f->due > part->queue.now ? f->due : part->queue.now, EV_SENSE, f, 0);
+}
+
+void flow_sense(sim_flow_s *f)
+{
+    sim_channel_s *ch = &channels[f->station->channel];
+    
+    if(channel_busy(ch)) {
+        f->state = FLOW_SENSE;
+        f->next = NULL;
+        *ch->waiters_tail = f;
+        ch->waiters_tail = &f->next;
+    }
+    else {
+        f->state = FLOW_IFS;
+        sim_push(&part->queue, part->queue.now + f->station->ifs, EV_IFS, f, 0);
+    }
+}
+
+void flow_backoff(sim_flow_s *f)
+{
+    sim_station_s *s = f->station;
+    
+    sim_log(s->log, s->name, "Timed out: K is now: %d and R is: %d", f->K, f->R);
+    sim_trace(TRACE_TIMEOUT, s->index, f->dst, f->K, f->R, f->size);
+    if(++f->K == 32) {
+        sim_log(s->log, s->name, "Number of attempts exceeded 32");
+        sim_trace(TRACE_DROP, s->index, f->dst, f->K, f->R, f->size);
+        flow_done(f, false);
+        return;
+    }
+    f->state = FLOW_BACKOFF;
+    sim_trace(TRACE_BACKOFF, s->index, f->dst, f->K, f->R, (uint32_t)(f->R*SIM_SLOT_TIME*1e9));
+    sim_push(&part->queue, part->queue.now + f->R*SIM_SLOT_TIME, EV_SENSE, f, 0);
+}
+
+/* Arrivals are stepped from the previous deadline, as in flow_next */
+void flow_done(sim_flow_s *f, bool acked)
+{
+    double gap, now = part->queue.now;
+    
+    if(acked) {
+        f->sent++;
+        f->station->goodput_frames++;
+        f->station->goodput_bytes += f->size;
+    }
+    else {
+        f->failed++;
+    }
+    if(!f->repeat || f->station->dead) {
+        f->state = FLOW_DONE;
+        return;
+    }
+    
+    f->offered++;
+    if(f->traffic.kind == TRAFFIC_SATURATE) {
+        f->due = now;
+        flow_delay(f);
+        return;
+    }
+    f->due += traffic_gap(&f->traffic, rng_unit(&f->station->rng));
+    while(f->due < now) {
+        gap = traffic_gap(&f->traffic, rng_unit(&f->station->rng));
+        if(gap <= 0 || f->due + gap > now)
+            break;
+        f->due += gap;
+        f->offered++;
+        f->overrun++;
+    }
+    flow_delay(f);
+}
@@ -0,0 +1,44 @@
+#ifndef SIM_H_
+#define SIM_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "shared.h"
+#include "rng.h"
+
+/*
+ Virtual time model. The wall clock engine has no notion of airtime,
+ so the simulator charges every frame SIM_BYTE_TIME per byte (1 Mbit/s)
+ and uses an 802.11 style backoff slot rather than TIME_SLOT.
+ */
+#define SIM_BYTE_TIME 8e-6
+#define SIM_SLOT_TIME 20e-6
+#define SIM_SEED 1
+
+typedef struct sim_event_s sim_event_s;
+typedef struct sim_queue_s sim_queue_s;
+
+/* Events are ordered by time, then by when they were scheduled */
+struct sim_event_s
+{
+    double time;
+    uint64_t seq;
+    int type;
+    uint32_t gen;
+    void *obj;
+};
+
+struct sim_queue_s
+{
+    sim_event_s *heap;
+    size_t size;
+    size_t bsize;
+    uint64_t seq;
+    double now;
+};
+
+extern void sim_run(double duration, int nchannels, size_t capacity, int nparts, uint64_t seed);
+
+#endif
@@ -0,0 +1,623 @@
+/* Station MAC: the CSMA/CA exchange shared by client processes and in-process stations */
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include "station.h"
+#include "trace.h"
+
+static void doCSMACA(mac_s *mac);
+static double clock_now(void);
+static void mac_collect(mac_s *mac);
+static void mac_drain(mac_s *mac);
+static void flow_start(mac_s *mac, msg_s *m, double now);
+static void flow_next(mac_s *mac, msg_s *m, double now);
+static void heap_push(mac_s *mac, msg_s *m);
+static msg_s *heap_pop(mac_s *mac);
+static void batch_take(mac_s *mac, batch_s *batch);
+static void batch_done(mac_s *mac, batch_s *batch, bool acked);
+static void batch_latency(mac_s *mac, batch_s *batch, int stage);
+static void latency_report(mac_s *mac, const char *dst, latency_s *l);
+static void sendRTS(mac_s *mac, batch_s *batch);
+static void send_frame(mac_s *mac, batch_s *batch);
+static bool check_ack_cts(mac_s *mac, cts_ack_s *data);
+
+void mac_init(mac_s *mac, char *name, double ifs, uint64_t seed, FILE *log)
+{
+    memset(mac, 0, sizeof(*mac));
+    
+    /* padded so that addresses can always be compared ADDR_SIZE bytes at a time */
+    mac->name_len = strlen(name);
+    mac->name = allocz(mac->name_len + ADDR_SIZE + 1);
+    memcpy(mac->name, name, mac->name_len);
+    if(mac->name_len > ADDR_SIZE)
+        mac->name_len = ADDR_SIZE;
+    mac->log = log;
+    mac->ifs.tv_sec = (long)ifs;
+    mac->ifs.tv_nsec = (long)((ifs - mac->ifs.tv_sec)*1e9);
+    rng_seed(&mac->rng, seed);
+    pthread_mutex_init(&mac->lock, NULL);
+    mac->txq_tail = &mac->txq;
+    mac->start = clock_now();
+    mac->refs = 1;
+}
+
+/*
+ Take a reference for a MAC or receive loop. Done before the loop is
+ started, so a kill that comes first can't free the station under it.
+ */
+void mac_hold(mac_s *mac)
+{
+    __atomic_add_fetch(&mac->refs, 1, __ATOMIC_ACQ_REL);
+}
+
+/*
+ Drop a reference; the last one closes the log and frees the station,
+ then tells the AP its id and inbox are no longer in use.
+ */
+void mac_release(mac_s *mac)
+{
+    uint32_t *attached;
+    
+    if(__atomic_sub_fetch(&mac->refs, 1, __ATOMIC_ACQ_REL))
+        return;
+    attached = mac->stats ? &mac->stats->attached : NULL;
+    log_close(mac->log);
+    pthread_mutex_destroy(&mac->lock);
+    free(mac->name);
+    free(mac);
+    if(attached)
+        __atomic_store_n(attached, 0, __ATOMIC_RELEASE);
+}
+
+/* Make the MAC and receive loops return; each drops its own reference */
+void mac_stop(mac_s *mac)
+{
+    mac_report(mac);
+    mac->dead = true;
+    __atomic_add_fetch(&mac->submitted, 1, __ATOMIC_SEQ_CST);
+    shm_wake(&mac->submitted, &mac->submitted_waiters);
+    shm_wake(&mac->inbox->size, &mac->inbox->size_waiters);
+    shm_wake(&mac->mediums->isbusy, &mac->mediums->busy_waiters);
+}
+
+/*
+ Log offered against achieved rate for each repeating flow, then the
+ station's goodput. mac_stop calls this on the stopping thread while
+ the MAC loop may still be finishing an exchange; repeating flows are
+ only freed once the loop has stopped, but the counts it reads are the
+ loop's own and may be an exchange behind. It formats with stdio, so it
+ is not for signal handlers. Only the first call reports.
+ */
+void mac_report(mac_s *mac)
+{
+    msg_s *m;
+    double elapsed, now = clock_now();
+    
+    if(__atomic_exchange_n(&mac->reported, true, __ATOMIC_ACQ_REL))
+        return;
+    for(m = __atomic_load_n(&mac->flows, __ATOMIC_ACQUIRE); m; m = m->flow_next) {
+        elapsed = now - m->start;
+        if(elapsed <= 0)
+            continue;
+        if(m->traffic.kind == TRAFFIC_SATURATE) {
+            mac_log(mac, "Flow to %s: saturated, achieved %.3f/s (%llu sent, %llu failed)",
+                    m->dst, m->sent/elapsed, (unsigned long long)m->sent, (unsigned long long)m->failed);
+            continue;
+        }
+        mac_log(mac, "Flow to %s: offered %.3f/s, achieved %.3f/s (%llu offered, %llu sent, %llu failed, %llu overrun)",
+                m->dst, m->offered/elapsed, m->sent/elapsed,
+                (unsigned long long)m->offered, (unsigned long long)m->sent,
+                (unsigned long long)m->failed, (unsigned long long)m->overrun);
+    }
+    for(m = __atomic_load_n(&mac->flows, __ATOMIC_ACQUIRE); m; m = m->flow_next)
+        latency_report(mac, m->dst, m->latency);
+    latency_report(mac, NULL, &mac->stats->latency);
+    elapsed = now - mac->start;
+    mac_log(mac, "Goodput: %.3f frames/s, %.3f kbit/s (%llu frames, %llu bytes in %.3f s)",
+            mac->goodput_frames/elapsed, mac->goodput_bytes*8e-3/elapsed,
+            (unsigned long long)mac->goodput_frames, (unsigned long long)mac->goodput_bytes, elapsed);
+}
+
+/*
+ Access delay percentiles of the flow to dst, or of the whole station.
+ Same constraints as mac_report: the histograms may still be recording.
+ */
+void latency_report(mac_s *mac, const char *dst, latency_s *l)
+{
+    static const char *stages[LAT_STAGES] = {"RTS", "CTS", "ACK"};
+    char line[256];
+    int i;
+    
+    for(i = 0; i < LAT_STAGES; i++) {
+        hist_format(&l->stage[i], line, sizeof(line));
+        if(dst)
+            mac_log(mac, "Flow to %s, delay to %s: %s", dst, stages[i], line);
+        else
+            mac_log(mac, "Delay to %s: %s", stages[i], line);
+    }
+}
+
+void mac_log(mac_s *mac, char *fs, ...)
+{
+    va_list args;
+    
+    va_start(args, fs);
+    vlogevent(mac->log, mac->name, fs, args);
+    va_end(args);
+}
+
+/* Copy a send for mac, with the payload's FCS computed once for every retry */
+msg_s *msg_new(mac_s *mac, char *dst, char *payload, size_t size, char *period, bool repeat)
+{
+    uint32_t *checkptr;
+    msg_s *m = allocz(sizeof(*m));
+    
+    m->mac = mac;
+    m->dlen = strlen(dst);
+    m->dst = strdup(dst);
+    m->size = size;
+    m->payload = alloc(size+sizeof(uint32_t)+1);
+    memcpy(m->payload, payload, size);
+    checkptr = (uint32_t *)&m->payload[size];
+    *checkptr = crc32c(m->payload, size);
+    m->payload[size+sizeof(uint32_t)] = '\0';
+    if(!traffic_parse(&m->traffic, period)) {
+        mac_log(mac, "Unknown period %s, sending back to back", period);
+        traffic_parse(&m->traffic, "0");
+    }
+    m->repeat = repeat;
+    if(repeat)
+        m->latency = allocz(sizeof(*m->latency));
+    return m;
+}
+
+void msg_free(msg_s *m)
+{
+    free(m->dst);
+    traffic_free(&m->traffic);
+    free(m->latency);
+    free(m->payload);
+    free(m);
+}
+
+/* Hand a flow to the station's MAC loop, from any thread */
+void mac_submit(mac_s *mac, msg_s *m)
+{
+    pthread_mutex_lock(&mac->lock);
+    m->next = mac->incoming;
+    mac->incoming = m;
+    pthread_mutex_unlock(&mac->lock);
+    __atomic_add_fetch(&mac->submitted, 1, __ATOMIC_SEQ_CST);
+    shm_wake(&mac->submitted, &mac->submitted_waiters);
+}
+
+/*
+ Body of the station's MAC thread or coroutine. Due flows move from the
+ heap to the TX queue, which is sent one RTS exchange at a time, so a
+ station never contends with itself for the medium. Drops the reference
+ its starter took with mac_hold.
+ */
+void mac_run(mac_s *mac)
+{
+    uint32_t seen;
+    double now;
+    
+    while(!mac->dead) {
+        seen = __atomic_load_n(&mac->submitted, __ATOMIC_ACQUIRE);
+        mac_collect(mac);
+        
+        now = clock_now();
+        while(mac->nheap && mac->heap[0]->due <= now) {
+            *mac->txq_tail = heap_pop(mac);
+            mac->txq_tail = &(*mac->txq_tail)->next;
+            *mac->txq_tail = NULL;
+        }
+        
+        if(mac->txq)
+            doCSMACA(mac);
+        else if(mac->nheap)
+            shm_wait(&mac->submitted, seen, &mac->submitted_waiters, 0, mac->heap[0]->due - now);
+        else
+            shm_wait(&mac->submitted, seen, &mac->submitted_waiters, 0, 0);
+    }
+    mac_drain(mac);
+    mac_release(mac);
+}
+
+double clock_now(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+/* Schedule flows handed over since the last pass, oldest first */
+void mac_collect(mac_s *mac)
+{
+    msg_s *m, *list = NULL, *next;
+    double now;
+    
+    if(!__atomic_load_n(&mac->incoming, __ATOMIC_ACQUIRE))
+        return;
+    pthread_mutex_lock(&mac->lock);
+    for(m = mac->incoming; m; m = next) {
+        next = m->next;
+        m->next = list;
+        list = m;
+    }
+    mac->incoming = NULL;
+    pthread_mutex_unlock(&mac->lock);
+    
+    now = clock_now();
+    for(m = list; m; m = next) {
+        next = m->next;
+        flow_start(mac, m, now);
+    }
+}
+
+void mac_drain(mac_s *mac)
+{
+    msg_s *m;
+    
+    pthread_mutex_lock(&mac->lock);
+    while((m = mac->incoming)) {
+        mac->incoming = m->next;
+        msg_free(m);
+    }
+    pthread_mutex_unlock(&mac->lock);
+    while((m = mac->txq)) {
+        mac->txq = m->next;
+        msg_free(m);
+    }
+    while(mac->nheap)
+        msg_free(heap_pop(mac));
+    free(mac->heap);
+}
+
+void flow_start(mac_s *mac, msg_s *m, double now)
+{
+    m->start = now;
+    m->due = now + traffic_start(&m->traffic, rng_unit(&mac->rng));
+    m->offered = 1;
+    if(m->repeat) {
+        m->flow_next = mac->flows;
+        __atomic_store_n(&mac->flows, m, __ATOMIC_RELEASE);
+    }
+    heap_push(mac, m);
+}
+
+/*
+ Step a repeating flow to its next arrival, counted from the previous
+ deadline. Arrivals that passed while its frame was still queued are
+ overruns; the latest of them is due at once. A saturated flow is
+ always due again as soon as its exchange ends.
+ */
+void flow_next(mac_s *mac, msg_s *m, double now)
+{
+    double gap;
+    
+    m->offered++;
+    if(m->traffic.kind == TRAFFIC_SATURATE) {
+        m->due = now;
+        heap_push(mac, m);
+        return;
+    }
+    m->due += traffic_gap(&m->traffic, rng_unit(&mac->rng));
+    while(m->due < now) {
+        gap = traffic_gap(&m->traffic, rng_unit(&mac->rng));
+        if(gap <= 0 || m->due + gap > now)
+            break;
+        m->due += gap;
+        m->offered++;
+        m->overrun++;
+    }
+    heap_push(mac, m);
+}
+
+void heap_push(mac_s *mac, msg_s *m)
+{
+    size_t i, p;
+    
+    if(mac->nheap == mac->heap_size) {
+        mac->heap_size = mac->heap_size ? 2*mac->heap_size : 16;
+        mac->heap = ralloc(mac->heap, mac->heap_size*sizeof(*mac->heap));
+    }
+    
+    for(i = mac->nheap++; i; i = p) {
+        p = (i-1)/2;
+        if(mac->heap[p]->due <= m->due)
+            break;
+        mac->heap[i] = mac->heap[p];
+    }
+    mac->heap[i] = m;
+}
+
+msg_s *heap_pop(mac_s *mac)
+{
+    size_t i, c;
+    msg_s *top = mac->heap[0], *last = mac->heap[--mac->nheap];
+    
+    for(i = 0; (c = 2*i+1) < mac->nheap; i = c) {
+        if(c+1 < mac->nheap && mac->heap[c+1]->due < mac->heap[c]->due)
+            c++;
+        if(last->due <= mac->heap[c]->due)
+            break;
+        mac->heap[i] = mac->heap[c];
+    }
+    mac->heap[i] = last;
+    return top;
+}
+
+/* Drain the inbox in place, sleeping on it when empty; drops the mac_hold reference */
+void mac_receive(mac_s *mac)
+{
+    slot_s *slot;
+    uint64_t cursor = 0;
+    uint32_t seen;
+    medium_s *inbox = mac->inbox;
+    
+    while(!mac->dead) {
+        seen = __atomic_load_n(&inbox->size, __ATOMIC_ACQUIRE);
+        slot = medium_peek(inbox, cursor);
+        if(slot) {
+            if(slot->size > ADDR_SIZE) {
+                mac_logat(mac, LOG_DEBUG, "Received Message %.*s from %.6s",
+                        (int)(slot->size - ADDR_SIZE), slot->data + ADDR_SIZE, slot->data);
+            }
+            medium_consume(inbox, ++cursor);
+        }
+        else {
+            shm_wait(&inbox->size, seen, &inbox->size_waiters, inbox->spin, WAIT_TIME);
+        }
+    }
+    mac_release(mac);
+}
+
+/* Main CSMA/CA Function: one exchange for the head of the TX queue */
+void doCSMACA(mac_s *mac)
+{
+    ssize_t status;
+    struct timespec ts;
+    cts_ack_s ackcts;
+    uint64_t cursor;
+    batch_s batch;
+    bool acked, backoff;
+    int i, K = 0, R;
+    
+    while(K != 32) {
+        /* wait until idle */
+        wait_idle(mac->mediums, &mac->dead);
+    
+        /* wait ifs time */
+        snooze(&mac->ifs);
+    
+        if(mac->dead)
+            return;
+        if(mac->mediums->isbusy)
+            continue;
+    
+        /* pick random number between 0 and 2^K - 1 */
+        R = rng_below(&mac->rng, 1u << K);
+    
+        /* payloads queued behind the head for its destination ride along */
+        batch_take(mac, &batch);
+    
+        /* Send Request to send */
+        cursor = medium_mark(mac->mediumc);
+        trace_emit(TRACE_RTS_TX, mac->id, batch.frames[0]->dst, K, R, batch.size);
+        sendRTS(mac, &batch);
+        stat_inc(mac->stats->rts);
+        batch_latency(mac, &batch, LAT_RTS);
+    
+        acked = backoff = false;
+        status = medium_read(mac->mediumc, &cursor, &ackcts, sizeof(ackcts));
+        /* if not timed out timed out */
+        if(status != EINTR)
+        if(ackcts.FC & CTS_SUBTYPE) {
+            backoff = true;
+            if(check_ack_cts(mac, &ackcts)) {
+                medium_consume(mac->mediumc, cursor);
+                mac_logat(mac, LOG_DEBUG, "GOT CTS");
+                stat_inc(mac->stats->cts);
+                batch_latency(mac, &batch, LAT_CTS);
+                trace_emit(TRACE_CTS_RX, mac->id, batch.frames[0]->dst, K, R, batch.size);
+    
+                /* wait ifs time */
+                snooze(&mac->ifs);
+    
+                trace_emit(TRACE_DATA_TX, mac->id, batch.frames[0]->dst, K, R, batch.size);
+                send_frame(mac, &batch);
+                stat_add(mac->stats->payloads, batch.count);
+                status = medium_read(mac->mediumc, &cursor, &ackcts, sizeof(ackcts));
+                if(status != EINTR)
+                if(ackcts.FC & ACK_SUBTYPE) {
+                    if(check_ack_cts(mac, &ackcts)) {
+                        medium_consume(mac->mediumc, cursor);
+                        acked = true;
+                    }
+                }
+            }
+        }
+        if(acked) {
+            mac_logat(mac, LOG_DEBUG, "Got Ack");
+            stat_inc(mac->stats->acks);
+            batch_latency(mac, &batch, LAT_ACK);
+            trace_emit(TRACE_ACK_RX, mac->id, batch.frames[0]->dst, K, R, batch.size);
+            for(i = 1; i < batch.count; i++)
+                mac_logat(mac, LOG_DEBUG, "Got Ack in aggregate");
+            batch_done(mac, &batch, true);
+            return;
+        }
+        if(backoff) {
+            mac_logat(mac, LOG_INFO, "Timed out: K is now: %d and R is: %d", K, R);
+            trace_emit(TRACE_TIMEOUT, mac->id, batch.frames[0]->dst, K, R, batch.size);
+            stat_inc(mac->stats->timeouts);
+            K++;
+            stat_inc(mac->stats->retries[K]);
+            ts.tv_nsec = R*TIME_SLOT;
+            ts.tv_sec = 0;
+            trace_emit(TRACE_BACKOFF, mac->id, batch.frames[0]->dst, K, R, ts.tv_nsec);
+            snooze(&ts);
+        }
+    }
+    
+    trace_emit(TRACE_DROP, mac->id, batch.frames[0]->dst, K, R, batch.size);
+    batch_done(mac, &batch, false);
+    mac_log(mac, "Number of attempts exceeded 32");
+}
+
+/*
+ Gather the head of the TX queue and the payloads queued after it for
+ the same destination, up to the uplink's aggregation limits. They stay
+ queued until batch_done.
+ */
+void batch_take(mac_s *mac, batch_s *batch)
+{
+    msg_s *m = mac->txq, *q;
+    size_t count = mac->mediums->agg_count < AGG_MAX ? mac->mediums->agg_count : AGG_MAX;
+    size_t size;
+    
+    batch->count = 1;
+    batch->frames[0] = m;
+    size = AGG_HEADER + m->size;
+    
+    for(q = m->next; q && batch->count < count; q = q->next) {
+        if(!strcmp(q->dst, m->dst) && size + AGG_HEADER + q->size <= mac->mediums->agg_bytes) {
+            batch->frames[batch->count++] = q;
+            size += AGG_HEADER + q->size;
+        }
+    }
+    batch->size = batch->count > 1 ? size : m->size;
+}
+
+/* Take a finished batch off the TX queue and reschedule repeating flows */
+void batch_done(mac_s *mac, batch_s *batch, bool acked)
+{
+    int i = 0;
+    msg_s **p, *m;
+    double now = clock_now();
+    
+    for(p = &mac->txq; (m = *p) && i < batch->count; ) {
+        if(m != batch->frames[i]) {
+            p = &m->next;
+            continue;
+        }
+        *p = m->next;
+        i++;
+        m->stages = 0;
+        if(acked) {
+            m->sent++;
+            mac->goodput_frames++;
+            mac->goodput_bytes += m->size;
+            stat_add(mac->stats->bytes, m->size);
+        }
+        else
+            m->failed++;
+        if(m->repeat)
+            flow_next(mac, m, now);
+        else
+            msg_free(m);
+    }
+    for(mac->txq_tail = &mac->txq; *mac->txq_tail; mac->txq_tail = &(*mac->txq_tail)->next)
+        ;
+}
+
+/*
+ Record how long each frame in the batch took to reach stage since it
+ was due, the first time it does. Frames that joined the batch on a
+ retry are timed from their own deadline.
+ */
+void batch_latency(mac_s *mac, batch_s *batch, int stage)
+{
+    int i;
+    msg_s *m;
+    double now = clock_now();
+    uint64_t ns;
+    
+    for(i = 0; i < batch->count; i++) {
+        m = batch->frames[i];
+        if(m->stages & (1 << stage))
+            continue;
+        m->stages |= 1 << stage;
+        ns = now > m->due ? (uint64_t)((now - m->due)*1e9) : 0;
+        hist_record(&mac->stats->latency.stage[stage], ns);
+        if(m->latency)
+            hist_record(&m->latency->stage[stage], ns);
+    }
+}
+
+/* Send Request To Send */
+void sendRTS(mac_s *mac, batch_s *batch)
+{
+    rts_s frame = {0};
+    msg_s *m = batch->frames[0];
+    
+    frame.FC = RTS_SUBTYPE;
+    if(batch->count > 1)
+        frame.FC |= FC_AGGREGATE;
+    frame.D = batch->size;
+    
+    memcpy(frame.addr1, mac->name, mac->name_len);
+    memcpy(frame.addr2, &m->dst[1], m->dlen-2 < ADDR_SIZE ? m->dlen-2 : ADDR_SIZE);
+    
+    frame.FCS = crc32c(&frame, sizeof(frame)-sizeof(uint32_t));
+    
+    medium_write(mac->mediums, &frame, sizeof(frame));
+    mac_logat(mac, LOG_DEBUG, "%s sent RTS", mac->name);
+}
+
+/*
+ Send Payload. An aggregate is a run of 16 bit length prefixed
+ payloads covered by a single FCS. One the medium can't hold is never
+ published, so the exchange times out.
+ */
+void send_frame(mac_s *mac, batch_s *batch)
+{
+    int i, status;
+    uint16_t len;
+    uint32_t crc = CRC_INIT, *checkptr;
+    char *frame, *p;
+    msg_s *m = batch->frames[0];
+    
+    if(batch->count == 1) {
+        status = medium_write(mac->mediums, m->payload, m->size + sizeof(uint32_t));
+        if(status)
+            mac_log(mac, "Payload of %zu bytes not sent: %s", m->size, strerror(status));
+        else
+            mac_logat(mac, LOG_DEBUG, "Sent Payload");
+        return;
+    }
+    
+    p = frame = alloc(batch->size + sizeof(uint32_t));
+    for(i = 0; i < batch->count; i++) {
+        len = (uint16_t)batch->frames[i]->size;
+        crc = crc_copy(crc, p, &len, AGG_HEADER);
+        crc = crc_copy(crc, p + AGG_HEADER, batch->frames[i]->payload, len);
+        p += AGG_HEADER + len;
+    }
+    checkptr = (uint32_t *)p;
+    *checkptr = crc_final(crc);
+    
+    status = medium_write(mac->mediums, frame, batch->size + sizeof(uint32_t));
+    if(status)
+        mac_log(mac, "Aggregate of %zu bytes not sent: %s", batch->size, strerror(status));
+    else
+        mac_logat(mac, LOG_DEBUG, "Sent Aggregate of %d payloads", batch->count);
+    free(frame);
+}
+
+/* Check if CTS or ACK are valid */
+bool check_ack_cts(mac_s *mac, cts_ack_s *data)
+{
+    uint32_t checksum;
+    
+    if(addr_cmp(mac->name, data->addr1)) {
+        checksum = crc32c(data, sizeof(*data)-sizeof(uint32_t));
+        if(checksum == data->FCS)
+            return true;
+    }
+    return false;
+}
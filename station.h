@@ -0,0 +1,113 @@
+#ifndef STATION_H_
+#define STATION_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#include "shared.h"
+#include "traffic.h"
+#include "rng.h"
+#include "stats.h"
+
+typedef struct mac_s mac_s;
+typedef struct msg_s msg_s;
+typedef struct batch_s batch_s;
+
+/*
+ A send() handed to a station: a flow that is transmitted once, or on
+ every arrival of its traffic process when repeat is set. due is the
+ absolute CLOCK_MONOTONIC deadline of its pending arrival. offered
+ counts arrivals, overrun those that came while the flow's previous
+ frame was still queued and were folded into it. stages marks which
+ access delays the queued frame has had recorded; repeating flows also
+ keep their own latency histograms.
+ */
+struct msg_s
+{
+    mac_s *mac;
+    size_t dlen;
+    char *dst;
+    size_t size;
+    char *payload;
+    traffic_s traffic;
+    bool repeat;
+    double start;
+    double due;
+    uint64_t offered;
+    uint64_t sent;
+    uint64_t failed;
+    uint64_t overrun;
+    latency_s *latency;
+    int stages;
+    msg_s *next;
+    msg_s *flow_next;
+};
+
+/* Payloads for one destination going out behind a single RTS */
+struct batch_s
+{
+    int count;
+    size_t size;
+    msg_s *frames[AGG_MAX];
+};
+
+/*
+ The CSMA/CA side of one station: what a client process keeps in its
+ globals, so that the AP can also host stations in-process. A single
+ MAC loop owns every flow. New sends are handed over on incoming and
+ wait in a heap ordered by due, then go out in order from the TX
+ queue. submitted is bumped on every hand-off and is the word the loop
+ sleeps on between deadlines. flows lists the repeating flows and
+ goodput counts what was acked since start, for mac_report. id is the
+ station's number in the AP's tables, which trace records carry, and
+ stats its counters in the run's stats segment.
+ */
+struct mac_s
+{
+    char *name;
+    size_t name_len;
+    uint32_t id;
+    station_stats_s *stats;
+    FILE *log;
+    struct timespec ifs;
+    rng_s rng;
+    medium_s *mediums;
+    medium_s *mediumc;
+    medium_s *inbox;
+    pthread_mutex_t lock;
+    msg_s *incoming;
+    uint32_t submitted;
+    uint32_t submitted_waiters;
+    msg_s **heap;
+    size_t nheap;
+    size_t heap_size;
+    msg_s *txq;
+    msg_s **txq_tail;
+    msg_s *flows;
+    double start;
+    uint64_t goodput_frames;
+    uint64_t goodput_bytes;
+    bool reported;
+    volatile bool dead;
+    int refs;
+};
+
+extern void mac_init(mac_s *mac, char *name, double ifs, uint64_t seed, FILE *log);
+extern void mac_hold(mac_s *mac);
+extern void mac_release(mac_s *mac);
+extern void mac_stop(mac_s *mac);
+extern msg_s *msg_new(mac_s *mac, char *dst, char *payload, size_t size, char *period, bool repeat);
+extern void msg_free(msg_s *m);
+extern void mac_submit(mac_s *mac, msg_s *m);
+extern void mac_run(mac_s *mac);
+extern void mac_receive(mac_s *mac);
+extern void mac_report(mac_s *mac);
+extern void mac_log(mac_s *mac, char *fs, ...);
+
+#define mac_logat(mac, level, ...) do { if(log_enabled(level)) mac_log(mac, __VA_ARGS__); } while(0)
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+
+#include "shared.h"
+#include "hist.h"
+
+#define STATS_MAGIC "CSMASTA1"
+#define STATS_KIND 'S'
+#define STATS_K 33
+
+/*
+ Counters in the stats segment have exactly one writer, so a relaxed
+ load and store is enough to keep readers from seeing torn values and
+ costs no more than a plain increment.
+ */
+#define stat_add(c, n) __atomic_store_n(&(c), __atomic_load_n(&(c), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define stat_inc(c) stat_add(c, 1)
+#define stat_get(c) __atomic_load_n(&(c), __ATOMIC_RELAXED)
+
+typedef struct latency_s latency_s;
+typedef struct station_stats_s station_stats_s;
+typedef struct channel_stats_s channel_stats_s;
+typedef struct stats_s stats_s;
+
+enum latency_e {
+    LAT_RTS,
+    LAT_CTS,
+    LAT_ACK,
+    LAT_STAGES
+};
+
+/*
+ Access delay of frames, from the deadline they entered the MAC at to
+ their first RTS, their first CTS and their ACK.
+ */
+struct latency_s
+{
+    hist_s stage[LAT_STAGES];
+};
+
+/*
+ One station's MAC counters, written only by its MAC loop. The AP
+ fills in name and channel when it creates the station and clears
+ active when it is killed; attached is cleared once the station's MAC
+ is gone, after which the AP may give the slot to a new station.
+ retries[K] counts backoffs to K and bytes the payload bytes acked.
+ */
+struct station_stats_s
+{
+    char name[ADDR_SIZE+2];
+    uint32_t channel;
+    uint32_t active;
+    uint32_t attached;
+    uint64_t rts;
+    uint64_t cts;
+    uint64_t payloads;
+    uint64_t acks;
+    uint64_t timeouts;
+    uint64_t bytes;
+    uint64_t retries[STATS_K];
+    latency_s latency;
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+ What one of the AP's request threads saw on its channel. delivery is
+ the time from a valid RTS to its payload landing in the inbox.
+ */
+struct channel_stats_s
+{
+    uint64_t rts_fcs;
+    uint64_t payload_fcs;
+    uint64_t unknown;
+    uint64_t timeouts;
+    uint64_t payload_timeouts;
+    hist_s delivery;
+} __attribute__((aligned(CACHE_LINE)));
+
+/*
+ The stats segment of a run, created by the AP and mapped by every
+ client; csma-stats reads it while the run goes on. running is cleared
+ when the AP exits.
+ */
+struct stats_s
+{
+    char magic[8];
+    uint32_t nchannels;
+    uint32_t nstations;
+    uint32_t running;
+    channel_stats_s channels[MAX_CHANNELS];
+    station_stats_s stations[MAX_STATIONS];
+};
+
+#endif
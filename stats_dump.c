@@ -0,0 +1,123 @@
+/* Reader for a run's stats segment: prints every station's MAC counters and the AP's per channel counters */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "shared.h"
+#include "stats.h"
+
+static void print_stats(stats_s *stats);
+static void print_latency(stats_s *stats);
+
+static bool latency;
+
+int main(int argc, char *argv[])
+{
+    int c;
+    double interval = 0;
+    char shm[SHM_NAME_SIZE];
+    stats_s *stats;
+    struct timespec ts;
+    
+    while((c = getopt(argc, argv, "i:l")) != -1) {
+        switch(c) {
+            case 'i':
+                interval = strtod(optarg, NULL);
+                break;
+            case 'l':
+                latency = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-i secs] [-l] run\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-i secs] [-l] run\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    
+    shm_name(shm, argv[optind], STATS_KIND, 0);
+    stats = shm_attach(shm);
+    if(memcmp(stats->magic, STATS_MAGIC, sizeof(stats->magic))) {
+        fprintf(stderr, "%s is not a stats segment\n", shm);
+        exit(EXIT_FAILURE);
+    }
+    
+    /* with -i, print again every interval until the AP exits */
+    print_stats(stats);
+    ts.tv_sec = (time_t)interval;
+    ts.tv_nsec = (long)((interval - ts.tv_sec)*1e9);
+    while(interval > 0 && __atomic_load_n(&stats->running, __ATOMIC_ACQUIRE)) {
+        nanosleep(&ts, NULL);
+        putchar('\n');
+        print_stats(stats);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+void print_stats(stats_s *stats)
+{
+    uint32_t i, n = __atomic_load_n(&stats->nstations, __ATOMIC_ACQUIRE);
+    int K;
+    channel_stats_s *ch;
+    station_stats_s *st;
+    
+    printf("channel  rts_fcs  payload_fcs  unknown  timeouts  payload_timeouts\n");
+    for(i = 0; i < stats->nchannels && i < MAX_CHANNELS; i++) {
+        ch = &stats->channels[i];
+        printf("%7u  %7" PRIu64 "  %11" PRIu64 "  %7" PRIu64 "  %8" PRIu64 "  %16" PRIu64 "\n", i,
+               stat_get(ch->rts_fcs), stat_get(ch->payload_fcs), stat_get(ch->unknown),
+               stat_get(ch->timeouts), stat_get(ch->payload_timeouts));
+    }
+    
+    printf("\nstation  channel  %8s  %8s  %8s  %8s  %8s  %10s  retries by K\n",
+           "rts", "cts", "payloads", "acks", "timeouts", "bytes");
+    for(i = 0; i < n && i < MAX_STATIONS; i++) {
+        st = &stats->stations[i];
+        /* killed stations are marked with a '*' */
+        printf("%-7.6s%c %7u  %8" PRIu64 "  %8" PRIu64 "  %8" PRIu64 "  %8" PRIu64 "  %8" PRIu64 "  %10" PRIu64 " ",
+               st->name, __atomic_load_n(&st->active, __ATOMIC_ACQUIRE) ? ' ' : '*', st->channel,
+               stat_get(st->rts), stat_get(st->cts), stat_get(st->payloads), stat_get(st->acks),
+               stat_get(st->timeouts), stat_get(st->bytes));
+        for(K = 1; K < STATS_K; K++)
+            if(stat_get(st->retries[K]))
+                printf(" %d:%" PRIu64, K, stat_get(st->retries[K]));
+        putchar('\n');
+    }
+    if(latency)
+        print_latency(stats);
+}
+
+/* Access delay per station and merged over all of them, then RTS to delivery per channel */
+void print_latency(stats_s *stats)
+{
+    static const char *stages[LAT_STAGES] = {"RTS", "CTS", "ACK"};
+    static hist_s all;
+    uint32_t i, n = __atomic_load_n(&stats->nstations, __ATOMIC_ACQUIRE);
+    int s;
+    char line[256];
+    
+    putchar('\n');
+    for(i = 0; i < n && i < MAX_STATIONS; i++) {
+        for(s = 0; s < LAT_STAGES; s++) {
+            hist_format(&stats->stations[i].latency.stage[s], line, sizeof(line));
+            printf("%-7.6s delay to %s: %s\n", stats->stations[i].name, stages[s], line);
+        }
+    }
+    for(s = 0; s < LAT_STAGES; s++) {
+        memset(&all, 0, sizeof(all));
+        for(i = 0; i < n && i < MAX_STATIONS; i++)
+            hist_merge(&all, &stats->stations[i].latency.stage[s]);
+        hist_format(&all, line, sizeof(line));
+        printf("all     delay to %s: %s\n", stages[s], line);
+    }
+    for(i = 0; i < stats->nchannels && i < MAX_CHANNELS; i++) {
+        hist_format(&stats->channels[i].delivery, line, sizeof(line));
+        printf("channel %u RTS to delivery: %s\n", i, line);
+    }
+}
@@ -0,0 +1,286 @@
+/* Per-process timer service: a hierarchical timing wheel driven by timerfd */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <signal.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include "timer.h"
+#include "shared.h"
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t service;
+static int tfd;
+
+/* current tick and number of armed timers */
+static uint64_t now;
+static size_t pending;
+static timer_s *wheel[TIMER_LEVELS][TIMER_SLOTS];
+
+static struct {
+    uint64_t started;
+    uint64_t fired;
+    uint64_t cancelled;
+    uint64_t slip_total;
+    uint64_t slip_max;
+} stats;
+
+static uint64_t clock_ns(void);
+static void timer_init(void);
+static void *timer_servicef(void *arg);
+static void arm(bool on);
+static void wheel_insert(timer_s *t);
+static void wheel_remove(timer_s *t);
+static void wheel_tick(void);
+static void fire(timer_s *t);
+static void drain_alarm(void);
+
+uint64_t clock_ns(void)
+{
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void timer_init(void)
+{
+    int status;
+    sigset_t mask, old;
+    
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if(tfd < 0) {
+        perror("Failed to create timerfd");
+        exit(EXIT_FAILURE);
+    }
+    
+    /* the service thread must never take signals meant for stations */
+    sigfillset(&mask);
+    pthread_sigmask(SIG_SETMASK, &mask, &old);
+    status = pthread_create(&service, NULL, timer_servicef, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if(status) {
+        perror("Failed to create timer service thread");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void *timer_servicef(void *arg)
+{
+    uint64_t expirations, target;
+    ssize_t status;
+    
+    while(true) {
+        status = read(tfd, &expirations, sizeof(expirations));
+        if(status < 0) {
+            if(errno == EINTR || errno == EAGAIN)
+                continue;
+            perror("Timer service read");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutex_lock(&lock);
+        target = clock_ns() / TIMER_TICK_NS;
+        while(pending && now < target)
+            wheel_tick();
+        now = target;
+        if(!pending)
+            arm(false);
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+/* Only tick while something is armed so idle processes stay asleep */
+void arm(bool on)
+{
+    struct itimerspec its = {{0}};
+    
+    if(on) {
+        its.it_interval.tv_nsec = TIMER_TICK_NS;
+        its.it_value.tv_nsec = TIMER_TICK_NS;
+    }
+    timerfd_settime(tfd, 0, &its, NULL);
+}
+
+/*
+ A deadline of now goes in the level 0 slot wheel_tick is about to
+ run, which only happens when a higher level cascades down.
+ */
+void wheel_insert(timer_s *t)
+{
+    int level;
+    uint64_t delta, slot;
+    timer_s **head;
+    
+    if(t->deadline < now)
+        t->deadline = now;
+    delta = t->deadline - now;
+    
+    for(level = 0; level < TIMER_LEVELS-1; level++) {
+        if(delta < (uint64_t)1 << (TIMER_SLOT_BITS*(level+1)))
+            break;
+    }
+    slot = (t->deadline >> (TIMER_SLOT_BITS*level)) & (TIMER_SLOTS-1);
+    
+    head = &wheel[level][slot];
+    t->prev = NULL;
+    t->next = *head;
+    if(*head)
+        (*head)->prev = t;
+    *head = t;
+    t->armed = true;
+}
+
+void wheel_remove(timer_s *t)
+{
+    int level;
+    uint64_t slot;
+    
+    if(t->prev) {
+        t->prev->next = t->next;
+    }
+    else {
+        /* head of its slot: find which one */
+        for(level = 0; level < TIMER_LEVELS; level++) {
+            slot = (t->deadline >> (TIMER_SLOT_BITS*level)) & (TIMER_SLOTS-1);
+            if(wheel[level][slot] == t) {
+                wheel[level][slot] = t->next;
+                break;
+            }
+        }
+    }
+    if(t->next)
+        t->next->prev = t->prev;
+    t->armed = false;
+}
+
+/* Advance one tick, cascading higher levels down as their slot comes due */
+void wheel_tick(void)
+{
+    int level;
+    timer_s *t, *next;
+    
+    now++;
+    for(level = 1; level < TIMER_LEVELS; level++) {
+        if(now & (((uint64_t)1 << (TIMER_SLOT_BITS*level)) - 1))
+            break;
+        t = wheel[level][(now >> (TIMER_SLOT_BITS*level)) & (TIMER_SLOTS-1)];
+        wheel[level][(now >> (TIMER_SLOT_BITS*level)) & (TIMER_SLOTS-1)] = NULL;
+        for(; t; t = next) {
+            next = t->next;
+            wheel_insert(t);
+        }
+    }
+    
+    t = wheel[0][now & (TIMER_SLOTS-1)];
+    wheel[0][now & (TIMER_SLOTS-1)] = NULL;
+    for(; t; t = next) {
+        next = t->next;
+        fire(t);
+    }
+}
+
+void fire(timer_s *t)
+{
+    uint64_t slip, ns = clock_ns();
+    
+    t->armed = false;
+    t->expired = 1;
+    pending--;
+    
+    slip = ns > t->deadline_ns ? ns - t->deadline_ns : 0;
+    stats.fired++;
+    stats.slip_total += slip;
+    if(slip > stats.slip_max)
+        stats.slip_max = slip;
+    
+    pthread_kill(t->owner, SIGALRM);
+}
+
+void timer_start(timer_s *t, double time)
+{
+    uint64_t ns;
+    
+    pthread_once(&once, timer_init);
+    
+    ns = clock_ns();
+    t->deadline_ns = ns + (uint64_t)(time > 0 ? time*1e9 : 0);
+    t->deadline = (t->deadline_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS;
+    t->expired = 0;
+    t->armed = false;
+    t->owner = pthread_self();
+    
+    pthread_mutex_lock(&lock);
+    if(!pending)
+        now = clock_ns() / TIMER_TICK_NS;
+    stats.started++;
+    
+    /* already due: the caller is the owner, so no signal is needed */
+    if(t->deadline_ns <= ns || t->deadline <= now) {
+        t->expired = 1;
+        stats.fired++;
+        pthread_mutex_unlock(&lock);
+        return;
+    }
+    if(!pending)
+        arm(true);
+    /* beyond the top level: clamp, the wheel only spans ~4.6 hours */
+    if(t->deadline - now >= (uint64_t)1 << (TIMER_SLOT_BITS*TIMER_LEVELS))
+        t->deadline = now + ((uint64_t)1 << (TIMER_SLOT_BITS*TIMER_LEVELS)) - 1;
+    wheel_insert(t);
+    pending++;
+    pthread_mutex_unlock(&lock);
+}
+
+bool timer_expired(timer_s *t)
+{
+    return t->expired;
+}
+
+/*
+ fire() signals under the lock, so once it is held here the SIGALRM of
+ an expired timer has been sent. If it is still pending it would cut
+ short whatever the owner blocks in next, so it is taken off.
+ */
+void timer_cancel(timer_s *t)
+{
+    pthread_mutex_lock(&lock);
+    if(t->armed) {
+        wheel_remove(t);
+        pending--;
+        stats.cancelled++;
+    }
+    pthread_mutex_unlock(&lock);
+    if(t->expired)
+        drain_alarm();
+}
+
+void drain_alarm(void)
+{
+    sigset_t alarm, old;
+    const struct timespec zero = {0, 0};
+    
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &alarm, &old);
+    sigtimedwait(&alarm, NULL, &zero);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+void timer_report(void)
+{
+    pthread_mutex_lock(&lock);
+    logevent(
+             "Timers: %llu started, %llu fired, %llu cancelled, slip avg %.3f ms max %.3f ms",
+             (unsigned long long)stats.started, (unsigned long long)stats.fired,
+             (unsigned long long)stats.cancelled,
+             stats.fired ? stats.slip_total/(double)stats.fired/1e6 : 0.0,
+             stats.slip_max/1e6
+             );
+    pthread_mutex_unlock(&lock);
+}
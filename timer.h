@@ -0,0 +1,38 @@
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <pthread.h>
+
+#define TIMER_TICK_NS 1000000
+#define TIMER_LEVELS 4
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+
+typedef struct timer_s timer_s;
+
+/*
+ A deadline owned by the caller, usually on its stack. The timer
+ service sets expired and sends SIGALRM to the owner thread so that
+ any blocking wait it is in returns early. A timer must be cancelled
+ (or have expired) before its storage goes away.
+ */
+struct timer_s
+{
+    uint64_t deadline;
+    uint64_t deadline_ns;
+    volatile uint32_t expired;
+    bool armed;
+    pthread_t owner;
+    timer_s *prev;
+    timer_s *next;
+};
+
+extern void timer_start(timer_s *t, double time);
+extern bool timer_expired(timer_s *t);
+extern void timer_cancel(timer_s *t);
+extern void timer_report(void);
+
+#endif
@@ -0,0 +1,151 @@
+/* Binary event trace: fixed size records in a file mapped by the AP and every client */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+trace_hdr_s *trace;
+
+static const char *names[TRACE_TYPES] = {
+    "NONE", "NODE", "RTS_TX", "CTS_RX", "DATA_TX", "ACK_RX",
+    "TIMEOUT", "BACKOFF", "DROP", "DELIVER", "AP_TIMEOUT", "FCS_ERROR"
+};
+
+static void *trace_map(const char *path, int flags, uint64_t size);
+
+/* Start a trace with room for records events; the file is sparse until written */
+void trace_create(const char *path, uint64_t records)
+{
+    struct timespec ts;
+    
+    trace = trace_map(path, O_RDWR|O_CREAT|O_TRUNC, sizeof(trace_hdr_s) + records*sizeof(trace_rec_s));
+    memcpy(trace->magic, TRACE_MAGIC, sizeof(trace->magic));
+    trace->version = TRACE_VERSION;
+    trace->rec_size = sizeof(trace_rec_s);
+    trace->capacity = records;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    trace->start_ns = (uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec;
+}
+
+/* Map the trace the AP created for this run */
+void trace_attach(const char *path)
+{
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        perror("Failed to open trace");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    trace = trace_map(path, O_RDWR, st.st_size);
+}
+
+void *trace_map(const char *path, int flags, uint64_t size)
+{
+    void *p;
+    int fd = open(path, flags, S_IRUSR|S_IWUSR);
+    
+    if(fd < 0) {
+        perror("Failed to open trace");
+        exit(EXIT_FAILURE);
+    }
+    if((flags & O_CREAT) && ftruncate(fd, size) < 0) {
+        perror("Failed to size trace");
+        exit(EXIT_FAILURE);
+    }
+    p = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(p == MAP_FAILED) {
+        perror("Failed to map trace");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    return p;
+}
+
+/* Map a finished trace read-only, checking that it is one */
+const trace_hdr_s *trace_open(const char *path, size_t *size)
+{
+    struct stat st;
+    const trace_hdr_s *hdr;
+    int fd = open(path, O_RDONLY);
+    
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        perror("Failed to open trace");
+        exit(EXIT_FAILURE);
+    }
+    if((size_t)st.st_size < sizeof(*hdr)) {
+        fprintf(stderr, "%s: too short for a trace\n", path);
+        exit(EXIT_FAILURE);
+    }
+    hdr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if(hdr == MAP_FAILED) {
+        perror("Failed to map trace");
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+    
+    if(memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) || hdr->version != TRACE_VERSION ||
+       hdr->rec_size != sizeof(trace_rec_s) ||
+       sizeof(*hdr) + hdr->capacity*sizeof(trace_rec_s) > (uint64_t)st.st_size) {
+        fprintf(stderr, "%s: not a version %d trace\n", path, TRACE_VERSION);
+        exit(EXIT_FAILURE);
+    }
+    *size = st.st_size;
+    return hdr;
+}
+
+const char *trace_name(int type)
+{
+    return type >= 0 && type < TRACE_TYPES ? names[type] : "UNKNOWN";
+}
+
+/*
+ Claim the next record and fill it in. peer is copied up to its first
+ quote or '\0', so quoted node names and raw frame addresses can both
+ be passed as they are.
+ */
+void trace_at(uint64_t ns, int type, uint32_t station, const char *peer, int K, int R, uint32_t size)
+{
+    trace_rec_s *rec;
+    uint64_t i;
+    int n;
+    
+    if(!trace)
+        return;
+    i = __atomic_fetch_add(&trace->count, 1, __ATOMIC_RELAXED);
+    if(i >= trace->capacity)
+        return;
+    rec = (trace_rec_s *)(trace + 1) + i;
+    rec->ns = ns;
+    rec->station = station;
+    rec->K = K;
+    rec->R = R;
+    rec->size = size;
+    memset(rec->peer, 0, sizeof(rec->peer));
+    if(peer) {
+        if(*peer == '"')
+            peer++;
+        for(n = 0; n < TRACE_PEER && peer[n] && peer[n] != '"'; n++)
+            rec->peer[n] = peer[n];
+    }
+    /* written last, so a reader never takes a half filled record for an event */
+    __atomic_store_n(&rec->type, type, __ATOMIC_RELEASE);
+}
+
+void trace_emit(int type, uint32_t station, const char *peer, int K, int R, uint32_t size)
+{
+    struct timespec ts;
+    
+    if(!trace)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    trace_at((uint64_t)ts.tv_sec*1000000000ull + ts.tv_nsec, type, station, peer, K, R, size);
+}
@@ -0,0 +1,84 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define TRACE_MAGIC "CSMATRC1"
+#define TRACE_VERSION 1
+#define TRACE_RECORDS (1 << 20)
+#define TRACE_AP UINT32_MAX
+#define TRACE_PEER 6
+
+typedef struct trace_hdr_s trace_hdr_s;
+typedef struct trace_rec_s trace_rec_s;
+
+/*
+ Event types. Station events come from doCSMACA, AP events from
+ process_request with station set to TRACE_AP. NODE records name a
+ station id and its channel and are written when it is created, so a
+ trace can be decoded without the logs.
+ */
+typedef enum {
+    TRACE_NONE,
+    TRACE_NODE,
+    TRACE_RTS_TX,
+    TRACE_CTS_RX,
+    TRACE_DATA_TX,
+    TRACE_ACK_RX,
+    TRACE_TIMEOUT,
+    TRACE_BACKOFF,
+    TRACE_DROP,
+    TRACE_DELIVER,
+    TRACE_AP_TIMEOUT,
+    TRACE_FCS_ERROR,
+    TRACE_TYPES
+} trace_event_e;
+
+/*
+ Start of a trace file. count is bumped by every writer to claim a
+ record and can run past capacity, in which case the excess records
+ were dropped. Slots still holding TRACE_NONE were claimed by a writer
+ that never finished.
+ */
+struct trace_hdr_s
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t rec_size;
+    uint64_t capacity;
+    uint64_t count;
+    uint64_t start_ns;
+    char pad[24];
+};
+
+/*
+ One event. ns is CLOCK_MONOTONIC, or virtual time under -S. peer is
+ an address of up to TRACE_PEER bytes: the destination for station
+ events, the sender for AP events and the station's own name for NODE.
+ K and R are the backoff exponent and slot count; NODE and AP events
+ keep a channel in K instead. size is the frame length in bytes, or the
+ backoff length in ns for BACKOFF.
+ */
+struct trace_rec_s
+{
+    uint64_t ns;
+    uint32_t station;
+    uint16_t type;
+    uint16_t K;
+    uint32_t R;
+    uint32_t size;
+    char peer[8];
+};
+
+extern trace_hdr_s *trace;
+
+extern void trace_create(const char *path, uint64_t records);
+extern void trace_attach(const char *path);
+extern const trace_hdr_s *trace_open(const char *path, size_t *size);
+extern const char *trace_name(int type);
+extern void trace_at(uint64_t ns, int type, uint32_t station, const char *peer, int K, int R, uint32_t size);
+extern void trace_emit(int type, uint32_t station, const char *peer, int K, int R, uint32_t size);
+
+#endif
@@ -0,0 +1,107 @@
+/* Decoder for event traces: prints each record as a line in the layout of the logs */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <sys/mman.h>
+
+#include "trace.h"
+
+static char (*names)[TRACE_PEER+1];
+static uint32_t nnames;
+
+static void name_station(uint32_t id, const char *peer);
+static bool station_named(uint32_t id);
+static const char *station_name(uint32_t id);
+
+int main(int argc, char *argv[])
+{
+    const trace_hdr_s *hdr;
+    const trace_rec_s *recs, *rec;
+    uint64_t i, count, ns;
+    size_t size;
+    
+    if(argc != 2) {
+        fprintf(stderr, "Usage: %s file\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    hdr = trace_open(argv[1], &size);
+    recs = (const trace_rec_s *)(hdr + 1);
+    count = hdr->count < hdr->capacity ? hdr->count : hdr->capacity;
+    
+    /*
+     stations are named up front, as a NODE can trail its first events,
+     and renamed at each later NODE when the AP reuses a killed one's id
+     */
+    for(i = 0; i < count; i++)
+        if(recs[i].type == TRACE_NODE && !station_named(recs[i].station))
+            name_station(recs[i].station, recs[i].peer);
+    
+    for(i = 0; i < count; i++) {
+        rec = &recs[i];
+        if(rec->type == TRACE_NONE)
+            continue;
+        if(rec->type == TRACE_NODE)
+            name_station(rec->station, rec->peer);
+        ns = rec->ns - hdr->start_ns;
+        printf("%.6s:\t%" PRIu64 ".%09" PRIu64 ":\t%s", station_name(rec->station),
+               ns/1000000000, ns%1000000000, trace_name(rec->type));
+        switch(rec->type) {
+            case TRACE_NODE:
+                printf(" channel=%u", rec->K);
+                break;
+            case TRACE_DELIVER:
+            case TRACE_AP_TIMEOUT:
+            case TRACE_FCS_ERROR:
+                printf(" %.*s channel=%u size=%u", TRACE_PEER, rec->peer, rec->K, rec->size);
+                break;
+            default:
+                printf(" %.*s K=%u R=%u size=%u", TRACE_PEER, rec->peer, rec->K, rec->R, rec->size);
+                break;
+        }
+        putchar('\n');
+    }
+    
+    if(hdr->count > hdr->capacity)
+        fprintf(stderr, "%" PRIu64 " events dropped, trace holds %" PRIu64 "\n",
+                hdr->count - hdr->capacity, hdr->capacity);
+    munmap((void *)hdr, size);
+    exit(EXIT_SUCCESS);
+}
+
+void name_station(uint32_t id, const char *peer)
+{
+    uint32_t n;
+    
+    if(id >= nnames) {
+        n = nnames ? nnames : 64;
+        while(n <= id)
+            n *= 2;
+        names = realloc(names, n*sizeof(*names));
+        if(!names) {
+            perror("Failed to allocate memory");
+            exit(EXIT_FAILURE);
+        }
+        memset(names + nnames, 0, (n - nnames)*sizeof(*names));
+        nnames = n;
+    }
+    memcpy(names[id], peer, TRACE_PEER);
+}
+
+bool station_named(uint32_t id)
+{
+    return id < nnames && names[id][0];
+}
+
+const char *station_name(uint32_t id)
+{
+    static char unknown[16];
+    
+    if(id == TRACE_AP)
+        return "ap";
+    if(station_named(id))
+        return names[id];
+    snprintf(unknown, sizeof(unknown), "#%u", id);
+    return unknown;
+}
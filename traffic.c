@@ -0,0 +1,150 @@
+/* Arrival processes for send() flows: constant rate, Poisson, on/off and trace replay */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "traffic.h"
+#include "shared.h"
+
+static bool load_trace(traffic_s *t, const char *file);
+
+/* False if spec names no known process or its trace can't be read */
+bool traffic_parse(traffic_s *t, const char *spec)
+{
+    char buf[SHM_NAME_SIZE*4], *arg, *end;
+    size_t len;
+    
+    memset(t, 0, sizeof(*t));
+    
+    /* string periods keep the quotes of their lexeme */
+    if(*spec == '"')
+        spec++;
+    len = strlen(spec);
+    if(len && spec[len-1] == '"')
+        len--;
+    if(len >= sizeof(buf))
+        return false;
+    memcpy(buf, spec, len);
+    buf[len] = '\0';
+    
+    if(!strcmp(buf, "saturate")) {
+        t->kind = TRAFFIC_SATURATE;
+        return true;
+    }
+    
+    arg = strchr(buf, ':');
+    if(!arg) {
+        t->kind = TRAFFIC_CBR;
+        arg = buf;
+    }
+    else {
+        *arg++ = '\0';
+        if(!strcmp(buf, "cbr"))
+            t->kind = TRAFFIC_CBR;
+        else if(!strcmp(buf, "poisson"))
+            t->kind = TRAFFIC_POISSON;
+        else if(!strcmp(buf, "onoff"))
+            t->kind = TRAFFIC_ONOFF;
+        else if(!strcmp(buf, "trace"))
+            return load_trace(t, arg);
+        else
+            return false;
+    }
+    
+    t->period = strtod(arg, &end);
+    if(end == arg)
+        return false;
+    if(t->period < 0)
+        t->period = 0;
+    if(t->kind == TRAFFIC_ONOFF) {
+        if(*end++ != ':')
+            return false;
+        t->on = strtod(end, &end);
+        if(*end++ != ':')
+            return false;
+        t->off = strtod(end, &end);
+        if(t->on <= 0 || t->off < 0)
+            return false;
+    }
+    return !*end;
+}
+
+bool load_trace(traffic_s *t, const char *file)
+{
+    FILE *f;
+    double gap;
+    size_t size = 0;
+    
+    t->kind = TRAFFIC_TRACE;
+    f = fopen(file, "r");
+    if(!f)
+        return false;
+    while(fscanf(f, "%lf", &gap) == 1) {
+        if(t->ngaps == size) {
+            size = size ? 2*size : 64;
+            t->gaps = ralloc(t->gaps, size*sizeof(*t->gaps));
+        }
+        t->gaps[t->ngaps++] = gap < 0 ? 0 : gap;
+    }
+    fclose(f);
+    return t->ngaps > 0;
+}
+
+/*
+ Offset of the first arrival from the time the flow is handed over.
+ Periodic processes start at a random phase u in [0, 1) so stations
+ given the same period don't all contend at once.
+ */
+double traffic_start(traffic_s *t, double u)
+{
+    switch(t->kind) {
+        case TRAFFIC_SATURATE:
+            return 0;
+        case TRAFFIC_POISSON:
+        case TRAFFIC_TRACE:
+            return traffic_gap(t, u);
+        case TRAFFIC_ONOFF:
+            t->pos = fmod(u*(t->on + t->off), t->on + t->off);
+            if(t->pos >= t->on) {
+                u = t->on + t->off - t->pos;
+                t->pos = 0;
+                return u;
+            }
+            return 0;
+        default:
+            return t->period*u;
+    }
+}
+
+/* Time from one arrival to the next, u is uniform in [0, 1) */
+double traffic_gap(traffic_s *t, double u)
+{
+    double gap;
+    
+    switch(t->kind) {
+        case TRAFFIC_POISSON:
+            return -t->period*log(1 - u);
+        case TRAFFIC_ONOFF:
+            if(t->pos + t->period < t->on) {
+                t->pos += t->period;
+                return t->period;
+            }
+            gap = t->on + t->off - t->pos;
+            t->pos = 0;
+            return gap;
+        case TRAFFIC_TRACE:
+            gap = t->gaps[t->next++];
+            if(t->next == t->ngaps)
+                t->next = 0;
+            return gap;
+        default:
+            return t->period;
+    }
+}
+
+void traffic_free(traffic_s *t)
+{
+    free(t->gaps);
+    t->gaps = NULL;
+}
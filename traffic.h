@@ -0,0 +1,43 @@
+#ifndef TRAFFIC_H_
+#define TRAFFIC_H_
+
+#include <stddef.h>
+#include <stdbool.h>
+
+typedef struct traffic_s traffic_s;
+
+typedef enum {
+    TRAFFIC_CBR,
+    TRAFFIC_POISSON,
+    TRAFFIC_ONOFF,
+    TRAFFIC_TRACE,
+    TRAFFIC_SATURATE
+} traffic_e;
+
+/*
+ Arrival process of a flow, parsed from send()'s period. A number or
+ "cbr:T" arrives every T seconds, "poisson:T" with exponential gaps of
+ mean T, "onoff:T:on:off" every T for on seconds then pauses for off,
+ and "trace:file" replays the gaps listed in file, looping at its end.
+ "saturate" has a new arrival the moment the previous frame is done.
+ Gaps are added to the previous deadline, not to the time the frame
+ went out, so a flow keeps its rate however long each exchange takes.
+ */
+struct traffic_s
+{
+    traffic_e kind;
+    double period;
+    double on;
+    double off;
+    double pos;
+    double *gaps;
+    size_t ngaps;
+    size_t next;
+};
+
+extern bool traffic_parse(traffic_s *t, const char *spec);
+extern double traffic_start(traffic_s *t, double u);
+extern double traffic_gap(traffic_s *t, double u);
+extern void traffic_free(traffic_s *t);
+
+#endif